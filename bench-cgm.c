@@ -0,0 +1,371 @@
+/* lxcfs
+ *
+ * Copyright © 2015 Canonical, Inc
+ *
+ * See COPYING file for details.
+ */
+
+/*
+ * An in-process stand-in for cgmanager.c, for lxcfs-bench.
+ *
+ * It serves a synthetic hierarchy for every controller: bench_cgroups
+ * cgroups named c0, c1, ... in a "bench" cgroup below bench_base, each
+ * holding bench_keys files named bench.key0, bench.key1, ... besides the
+ * few real ones lxcfs reads.  All values are made up, and nothing can be
+ * changed.  Everything else in the tree, which is the cgroups on the way
+ * down to bench_base, is there but empty.
+ *
+ * Cgroups are passed around here without their leading '/', with the root
+ * being "".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/macros.h>
+
+#include "cgmanager.h"
+
+char *bench_base = "";
+int bench_cgroups = 100;
+int bench_keys = 20;
+
+static const char *real_keys[] = {
+	"tasks",
+	"cgroup.procs",
+	"memory.limit_in_bytes",
+	"memory.usage_in_bytes",
+	"memory.stat",
+	"memory.memsw.limit_in_bytes",
+	"memory.memsw.usage_in_bytes",
+	"cpuset.cpus",
+	"cpu.cfs_quota_us",
+	"cpu.cfs_period_us",
+	"blkio.io_serviced_recursive",
+	"blkio.io_service_bytes_recursive",
+	"blkio.io_wait_time_recursive",
+	NULL,
+};
+
+static const char *skip_slash(const char *cg)
+{
+	while (*cg == '/')
+		cg++;
+	return cg;
+}
+
+static char *bench_root(void)
+{
+	return *bench_base ?
+		NIH_MUST( nih_sprintf(NULL, "%s/bench", bench_base) ) :
+		NIH_MUST( nih_strdup(NULL, "bench") );
+}
+
+/* 0: no such cgroup, 1: on the way down to the bench cgroups, 2: one of them */
+static int lookup(const char *cg)
+{
+	nih_local char *root = bench_root();
+	size_t len;
+	char *end;
+	long i;
+
+	cg = skip_slash(cg);
+	len = strlen(cg);
+	if (strncmp(root, cg, len) == 0 && (!len || root[len] == '/' || !root[len]))
+		return 1;
+	len = strlen(root);
+	if (strncmp(cg, root, len) != 0 || cg[len] != '/' || cg[len+1] != 'c')
+		return 0;
+	i = strtol(cg + len + 2, &end, 10);
+	if (*end || i < 0 || i >= bench_cgroups)
+		return 0;
+	return 2;
+}
+
+void cgm_init(void)
+{
+}
+
+void cgm_close(void)
+{
+}
+
+bool cgm_get_controllers(char ***contrls)
+{
+	*contrls = NIH_MUST( nih_str_split(NULL, "memory cpuset", " ", true) );
+	return true;
+}
+
+bool cgm_list_keys(const char *controller, const char *cgroup, struct cgm_keys ***keys)
+{
+	struct cgm_keys **list;
+	int i, n = 0;
+
+	if (lookup(cgroup) == 0)
+		return false;
+
+	/* real_keys has room for the NULL */
+	list = NIH_MUST( nih_alloc(NULL, (bench_keys + sizeof(real_keys) / sizeof(*real_keys)) *
+				sizeof(*list)) );
+	for (i = 0; real_keys[i]; i++) {
+		list[n] = NIH_MUST( nih_new(list, struct cgm_keys) );
+		list[n]->name = NIH_MUST( nih_strdup(list[n], real_keys[i]) );
+		list[n]->uid = list[n]->gid = 0;
+		list[n++]->mode = 0644;
+	}
+	for (i = 0; lookup(cgroup) == 2 && i < bench_keys; i++) {
+		list[n] = NIH_MUST( nih_new(list, struct cgm_keys) );
+		list[n]->name = NIH_MUST( nih_sprintf(list[n], "bench.key%d", i) );
+		list[n]->uid = list[n]->gid = 0;
+		list[n++]->mode = 0644;
+	}
+	list[n] = NULL;
+	*keys = list;
+	return true;
+}
+
+bool cgm_list_children(const char *controller, const char *cgroup, char ***list)
+{
+	nih_local char *root = bench_root();
+	const char *next;
+	size_t len;
+	int i;
+
+	switch (lookup(cgroup)) {
+	case 0:
+		return false;
+	case 2:
+		*list = NIH_MUST( nih_str_array_new(NULL) );
+		return true;
+	}
+
+	cgroup = skip_slash(cgroup);
+	len = strlen(cgroup);
+	if (strcmp(cgroup, root) == 0) {
+		*list = NIH_MUST( nih_alloc(NULL, (bench_cgroups + 1) * sizeof(char *)) );
+		for (i = 0; i < bench_cgroups; i++)
+			(*list)[i] = NIH_MUST( nih_sprintf(*list, "c%d", i) );
+		(*list)[i] = NULL;
+		return true;
+	}
+
+	/* the next component on the way down */
+	next = root + (len ? len + 1 : 0);
+	*list = NIH_MUST( nih_alloc(NULL, 2 * sizeof(char *)) );
+	(*list)[0] = NIH_MUST( nih_strndup(*list, next, strcspn(next, "/")) );
+	(*list)[1] = NULL;
+	return true;
+}
+
+char *cgm_get_pid_cgroup(pid_t pid, const char *controller)
+{
+	return NIH_MUST( nih_sprintf(NULL, "/%s", bench_base) );
+}
+
+bool cgm_get_value(const char *controller, const char *cgroup, const char *file,
+		char **value)
+{
+	if (lookup(cgroup) == 0)
+		return false;
+
+	if (strcmp(file, "memory.limit_in_bytes") == 0)
+		*value = NIH_MUST( nih_strdup(NULL, "1073741824\n") );
+	else if (strcmp(file, "memory.usage_in_bytes") == 0)
+		*value = NIH_MUST( nih_strdup(NULL, "268435456\n") );
+	else if (strcmp(file, "memory.memsw.limit_in_bytes") == 0)
+		*value = NIH_MUST( nih_strdup(NULL, "1610612736\n") );
+	else if (strcmp(file, "memory.memsw.usage_in_bytes") == 0)
+		*value = NIH_MUST( nih_strdup(NULL, "301989888\n") );
+	else if (strcmp(file, "memory.stat") == 0)
+		*value = NIH_MUST( nih_strdup(NULL,
+			"cache 134217728\nrss 134217728\nrss_huge 0\n"
+			"mapped_file 16777216\nwriteback 0\npgpgin 100000\n"
+			"pgpgout 50000\npgfault 200000\npgmajfault 100\n"
+			"inactive_anon 0\nactive_anon 134217728\n"
+			"inactive_file 67108864\nactive_file 67108864\n"
+			"unevictable 0\nhierarchical_memory_limit 1073741824\n"
+			"total_cache 134217728\ntotal_rss 134217728\n") );
+	else if (strcmp(file, "cpuset.cpus") == 0)
+		*value = NIH_MUST( nih_strdup(NULL, "0-1\n") );
+	else if (strcmp(file, "cpu.cfs_quota_us") == 0)
+		*value = NIH_MUST( nih_strdup(NULL, "50000\n") );
+	else if (strcmp(file, "cpu.cfs_period_us") == 0)
+		*value = NIH_MUST( nih_strdup(NULL, "100000\n") );
+	else if (strncmp(file, "blkio.io_", 9) == 0)
+		*value = NIH_MUST( nih_strdup(NULL,
+			"254:0 Read 1000\n254:0 Write 2000\n254:0 Sync 2500\n"
+			"254:0 Async 500\n254:0 Total 3000\n"
+			"254:16 Read 4096\n254:16 Write 0\n254:16 Sync 4096\n"
+			"254:16 Async 0\n254:16 Total 4096\nTotal 7096\n") );
+	else if (strcmp(file, "tasks") == 0 || strcmp(file, "cgroup.procs") == 0)
+		*value = NIH_MUST( nih_strdup(NULL, "") );
+	else
+		*value = NIH_MUST( nih_strdup(NULL, "0\n") );
+	return true;
+}
+
+bool cgm_set_value(const char *controller, const char *cgroup, const char *file,
+		const char *value)
+{
+	return false;
+}
+
+bool cgm_create(const char *controller, const char *cg, uid_t uid, gid_t gid)
+{
+	return false;
+}
+
+bool cgm_chown_file(const char *controller, const char *cg, uid_t uid, gid_t gid)
+{
+	return false;
+}
+
+bool cgm_chmod_file(const char *controller, const char *file, mode_t mode)
+{
+	return false;
+}
+
+bool cgm_remove(const char *controller, const char *cg)
+{
+	return false;
+}
+
+bool cgm_escape_cgroup(void)
+{
+	return true;
+}
+
+bool cgm_move_pid(const char *controller, const char *cgroup, pid_t pid)
+{
+	return false;
+}
+
+/*
+ * Batches just run their calls one by one when sent.  The results
+ * belong to the batch, as with the real thing.
+ */
+enum bench_call_type {
+	BENCH_LIST_KEYS,
+	BENCH_LIST_CHILDREN,
+	BENCH_GET_VALUE,
+};
+
+struct bench_call {
+	enum bench_call_type type;
+	char *controller, *cgroup, *file;
+	void **result;
+	bool quiet;
+	struct bench_call *next;
+};
+
+struct cgm_batch {
+	struct bench_call *calls, **tail;
+	bool quiet, failed;
+};
+
+struct cgm_batch *cgm_batch_new(void)
+{
+	struct cgm_batch *b;
+
+	b = NIH_MUST( nih_new(NULL, struct cgm_batch) );
+	b->calls = NULL;
+	b->tail = &b->calls;
+	b->quiet = b->failed = false;
+	return b;
+}
+
+void cgm_batch_quiet(struct cgm_batch *b, bool quiet)
+{
+	b->quiet = quiet;
+}
+
+static void batch_add(struct cgm_batch *b, enum bench_call_type type,
+		const char *controller, const char *cgroup, const char *file,
+		void **result)
+{
+	struct bench_call *c;
+
+	c = NIH_MUST( nih_new(b, struct bench_call) );
+	c->type = type;
+	c->controller = NIH_MUST( nih_strdup(c, controller) );
+	c->cgroup = NIH_MUST( nih_strdup(c, cgroup) );
+	c->file = file ? NIH_MUST( nih_strdup(c, file) ) : NULL;
+	c->result = result;
+	*result = NULL;
+	c->quiet = b->quiet;
+	c->next = NULL;
+	*b->tail = c;
+	b->tail = &c->next;
+}
+
+void cgm_batch_list_keys(struct cgm_batch *b, const char *controller,
+		const char *cgroup, struct cgm_keys ***keys)
+{
+	batch_add(b, BENCH_LIST_KEYS, controller, cgroup, NULL, (void **)keys);
+}
+
+void cgm_batch_list_children(struct cgm_batch *b, const char *controller,
+		const char *cgroup, char ***list)
+{
+	batch_add(b, BENCH_LIST_CHILDREN, controller, cgroup, NULL, (void **)list);
+}
+
+void cgm_batch_get_value(struct cgm_batch *b, const char *controller,
+		const char *cgroup, const char *file, char **value)
+{
+	batch_add(b, BENCH_GET_VALUE, controller, cgroup, file, (void **)value);
+}
+
+void cgm_batch_send(struct cgm_batch *b)
+{
+	struct bench_call *c;
+	bool ok = false;
+
+	for (c = b->calls; c; c = c->next) {
+		switch (c->type) {
+		case BENCH_LIST_KEYS:
+			ok = cgm_list_keys(c->controller, c->cgroup,
+					(struct cgm_keys ***)c->result);
+			break;
+		case BENCH_LIST_CHILDREN:
+			ok = cgm_list_children(c->controller, c->cgroup,
+					(char ***)c->result);
+			break;
+		case BENCH_GET_VALUE:
+			ok = cgm_get_value(c->controller, c->cgroup, c->file,
+					(char **)c->result);
+			break;
+		}
+		if (ok)
+			nih_ref(*c->result, b);
+		else if (!c->quiet)
+			b->failed = true;
+	}
+}
+
+bool cgm_batch_wait(struct cgm_batch *b)
+{
+	struct bench_call *c;
+	bool ret;
+
+	while ((c = b->calls)) {
+		b->calls = c->next;
+		nih_free(c);
+	}
+	b->tail = &b->calls;
+	ret = !b->failed;
+	b->failed = false;
+	return ret;
+}
+
+bool cgm_batch_run(struct cgm_batch *b)
+{
+	cgm_batch_send(b);
+	return cgm_batch_wait(b);
+}
@@ -0,0 +1,247 @@
+/* lxcfs
+ *
+ * Copyright © 2015 Canonical, Inc
+ *
+ * See COPYING file for details.
+ */
+
+/*
+ * lxcfs-bench: time the filesystem ops in a tight loop, without fuse or
+ * cgmanager.
+ *
+ * lxcfs.c is built right into this file, so that the ops can be called
+ * directly with a made up fuse context, and is linked against the mock
+ * backend in bench-cgm.c.  Since the ops check the caller's cgroup in
+ * /proc/self/cgroup, the mock hierarchy is put below our own memory
+ * cgroup.
+ *
+ * Every allocation goes through the malloc() below and is counted.
+ */
+#define LXCFS_BENCH
+#include "lxcfs.c"
+
+extern char *bench_base;
+extern int bench_cgroups, bench_keys;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long nr_allocs;
+
+void *malloc(size_t size)
+{
+	nr_allocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	nr_allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	nr_allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+static char **dir_paths, **file_paths, **stat_paths;
+static char *bench_dir, *base_cg;
+static char readbuf[65536];
+
+static int bench_filler(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	return 0;
+}
+
+static int bench_getattr_cgroup(int i)
+{
+	struct stat sb;
+
+	return lxcfs_getattr(dir_paths[i % bench_cgroups], &sb);
+}
+
+static int bench_getattr_key(int i)
+{
+	struct stat sb;
+
+	return lxcfs_getattr(file_paths[i % (bench_cgroups * bench_keys)], &sb);
+}
+
+static int bench_getattr_proc(int i)
+{
+	struct stat sb;
+
+	return lxcfs_getattr("/proc/meminfo", &sb);
+}
+
+static int bench_readdir_children(int i)
+{
+	struct fuse_file_info fi = { 0 };
+
+	return lxcfs_readdir(bench_dir, NULL, bench_filler, 0, &fi);
+}
+
+static int bench_readdir_keys(int i)
+{
+	struct fuse_file_info fi = { 0 };
+
+	return lxcfs_readdir(dir_paths[i % bench_cgroups], NULL, bench_filler, 0, &fi);
+}
+
+/* the value is read at open, see cg_open */
+static int bench_read_cgroup(int i)
+{
+	struct fuse_file_info fi = { 0 };
+	const char *path = stat_paths[i % bench_cgroups];
+	int ret;
+
+	if ((ret = lxcfs_open(path, &fi)) < 0)
+		return ret;
+	ret = lxcfs_read(path, readbuf, sizeof(readbuf), 0, &fi);
+	lxcfs_release(path, &fi);
+	return ret;
+}
+
+static int bench_read_meminfo(int i)
+{
+	struct fuse_file_info fi = { 0 };
+
+	return lxcfs_read("/proc/meminfo", readbuf, sizeof(readbuf), 0, &fi);
+}
+
+/*
+ * As with -o refresh, but with no refresher the view is never redone.
+ * Only this bench may read views, the others must render.
+ */
+static int bench_read_meminfo_view(int i)
+{
+	struct fuse_file_info fi = { 0 };
+	double refresh = proc_refresh;
+	int ret;
+
+	proc_refresh = 1;
+	ret = lxcfs_read("/proc/meminfo", readbuf, sizeof(readbuf), 0, &fi);
+	proc_refresh = refresh;
+	return ret;
+}
+
+static int bench_read_diskstats(int i)
+{
+	struct fuse_file_info fi = { 0 };
+
+	return lxcfs_read("/proc/diskstats", readbuf, sizeof(readbuf), 0, &fi);
+}
+
+static int bench_meminfo_render(int i)
+{
+	return proc_meminfo_read(&lxcfs_ctx, base_cg, readbuf, sizeof(readbuf));
+}
+
+static struct bench {
+	const char *name;
+	int (*fn)(int i);
+} benches[] = {
+	{ "getattr /cgroup dir", bench_getattr_cgroup },
+	{ "getattr /cgroup file", bench_getattr_key },
+	{ "getattr /proc/meminfo", bench_getattr_proc },
+	{ "readdir /cgroup children", bench_readdir_children },
+	{ "readdir /cgroup keys", bench_readdir_keys },
+	{ "open+read /cgroup memory.stat", bench_read_cgroup },
+	{ "read /proc/meminfo", bench_read_meminfo },
+	{ "read /proc/diskstats", bench_read_diskstats },
+	{ "read /proc/meminfo, refresh", bench_read_meminfo_view },
+	{ "proc_meminfo_read", bench_meminfo_render },
+	{ NULL, NULL },
+};
+
+static void run(struct bench *b, int iterations)
+{
+	unsigned long allocs;
+	uint64_t start;
+	int i, ret = 0;
+
+	/* warm up, and make sure the op works at all */
+	for (i = 0; i < 10; i++)
+		ret = b->fn(i);
+	if (ret < 0) {
+		printf("%-28s failed: %s\n", b->name, strerror(-ret));
+		return;
+	}
+
+	allocs = nr_allocs;
+	start = stats_now();
+	for (i = 0; i < iterations; i++)
+		b->fn(i);
+	printf("%-28s %10.0f ns/op %8.1f allocs/op\n", b->name,
+		(double) (stats_now() - start) / iterations,
+		(double) (nr_allocs - allocs) / iterations);
+}
+
+static void bench_usage(const char *me)
+{
+	fprintf(stderr, "Usage: %s [-n cgroups] [-k keys] [-i iterations]\n", me);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct lxcfs_state state = { 0 };
+	int c, i, j, iterations = 10000;
+	char *cg;
+
+	while ((c = getopt(argc, argv, "n:k:i:")) != -1) {
+		switch (c) {
+		case 'n': bench_cgroups = atoi(optarg); break;
+		case 'k': bench_keys = atoi(optarg); break;
+		case 'i': iterations = atoi(optarg); break;
+		default: bench_usage(argv[0]);
+		}
+	}
+	if (bench_cgroups < 1 || bench_keys < 1 || iterations < 1)
+		bench_usage(argv[0]);
+
+	cg = get_pid_cgroup(getpid(), "memory");
+	if (!cg) {
+		fprintf(stderr, "not in a memory cgroup, the /cgroup numbers "
+				"will be for access being refused\n");
+		cg = "/";
+	}
+	while (*cg == '/')
+		cg++;
+	bench_base = cg;
+	base_cg = *cg ? cg : "/";
+
+	proc_files_init();
+	node_init();
+	if (!cgm_get_controllers(&state.subsystems))
+		return 1;
+	state.cg_timeout = 1.0;
+	state.threads = 1;
+
+	lxcfs_ctx.uid = getuid();
+	lxcfs_ctx.gid = getgid();
+	lxcfs_ctx.pid = getpid();
+	lxcfs_ctx.private_data = &state;
+
+	bench_dir = NIH_MUST( nih_sprintf(NULL, "/cgroup/memory/%s%sbench",
+			bench_base, *bench_base ? "/" : "") );
+	dir_paths = NIH_MUST( nih_alloc(NULL, bench_cgroups * sizeof(char *)) );
+	stat_paths = NIH_MUST( nih_alloc(NULL, bench_cgroups * sizeof(char *)) );
+	file_paths = NIH_MUST( nih_alloc(NULL, bench_cgroups * bench_keys * sizeof(char *)) );
+	for (i = 0; i < bench_cgroups; i++) {
+		dir_paths[i] = NIH_MUST( nih_sprintf(dir_paths, "%s/c%d", bench_dir, i) );
+		stat_paths[i] = NIH_MUST( nih_sprintf(stat_paths, "%s/memory.stat", dir_paths[i]) );
+		for (j = 0; j < bench_keys; j++)
+			file_paths[i * bench_keys + j] = NIH_MUST( nih_sprintf(file_paths,
+					"%s/bench.key%d", dir_paths[i], j) );
+	}
+
+	printf("%d cgroups of %d keys, below %s, %d iterations\n",
+		bench_cgroups, bench_keys, base_cg, iterations);
+	for (i = 0; benches[i].name; i++)
+		run(&benches[i], iterations);
+	return 0;
+}
@@ -51,9 +51,49 @@
 #include <nih/string.h>
 
 #include "cgmanager.h"
+#include "stats.h"
+#include "probes.h"
 
-static NihDBusProxy *cgroup_manager = NULL;
-static int32_t api_version;
+/*
+ * Each thread keeps its own connection to cgmanager open across calls.
+ *
+ * libnih reports errors through a process-wide error stack, which
+ * nih-dbus pushes to from inside the calls.  So while the connections
+ * are per thread, the calls themselves, up to and including fetching
+ * any error, are serialized by cgm_mutex.
+ */
+static __thread NihDBusProxy *cgroup_manager = NULL;
+static __thread int32_t api_version;
+static pthread_mutex_t cgm_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Time and trace a call to cgmanager about @cg, which returns 0 on
+ * success.
+ */
+#define cgm_timed(which, cg, call) ({					\
+		uint64_t __start = stats_now();				\
+		int __ret;						\
+		LXCFS_PROBE2(cgm__entry, stats_cgm_name(which), cg);	\
+		__ret = (call);						\
+		LXCFS_PROBE3(cgm__return, stats_cgm_name(which), cg, __ret); \
+		stats_cgm(which, __start, __ret == 0);			\
+		__ret;							\
+	})
+
+static void cgm_lock(void)
+{
+	pthread_mutex_lock(&cgm_mutex);
+}
+
+static void cgm_unlock(void)
+{
+	pthread_mutex_unlock(&cgm_mutex);
+}
+
+void cgm_init(void)
+{
+	dbus_threads_init_default();
+}
 
 static void cgm_dbus_disconnect(void)
 {
@@ -65,15 +105,43 @@ static void cgm_dbus_disconnect(void)
        cgroup_manager = NULL;
 }
 
+/*
+ * Drop this thread's connection, for instance before forking.
+ */
+void cgm_close(void)
+{
+	cgm_lock();
+	cgm_dbus_disconnect();
+	cgm_unlock();
+}
+
 #define CGMANAGER_DBUS_SOCK "unix:path=/sys/fs/cgroup/cgmanager/sock"
+
+/*
+ * The D-Bus address of cgmanager can be overridden through the environment,
+ * for instance to point lxcfs at mock-cgmanager.
+ */
+static const char *cgm_dbus_address(void)
+{
+	const char *address = getenv("CGMANAGER_DBUS_SOCK");
+
+	return address && *address ? address : CGMANAGER_DBUS_SOCK;
+}
+
 static bool cgm_dbus_connect(void)
 {
 	DBusError dbus_error;
-	static DBusConnection *connection;
+	DBusConnection *connection;
+
+	if (cgroup_manager) {
+		if (dbus_connection_get_is_connected(cgroup_manager->connection))
+			return true;
+		cgm_dbus_disconnect();
+	}
 
 	dbus_error_init(&dbus_error);
 
-	connection = dbus_connection_open_private(CGMANAGER_DBUS_SOCK, &dbus_error);
+	connection = dbus_connection_open_private(cgm_dbus_address(), &dbus_error);
 	if (!connection) {
 		fprintf(stderr, "Failed opening dbus connection: %s: %s\n",
 				dbus_error.name, dbus_error.message);
@@ -109,59 +177,68 @@ static bool cgm_dbus_connect(void)
 
 bool cgm_get_controllers(char ***contrls)
 {
+	cgm_lock();
 	if (!cgm_dbus_connect()) {
+		cgm_unlock();
 		return false;
 	}
 
-	if ( cgmanager_list_controllers_sync(NULL, cgroup_manager, contrls) != 0 ) {
+	if ( cgm_timed(STATS_CGM_GET_CONTROLLERS, "", cgmanager_list_controllers_sync(NULL, cgroup_manager, contrls)) != 0 ) {
 		NihError *nerr;
 		nerr = nih_error_get();
 		fprintf(stderr, "call to list_controllers failed: %s\n", nerr->message);
 		nih_free(nerr);
 		cgm_dbus_disconnect();
+		cgm_unlock();
 		return false;
 	}
 
-	cgm_dbus_disconnect();
+	cgm_unlock();
 	return true;
 }
 
-bool cgm_list_keys(const char *controller, const char *cgroup, struct cgm_keys ***keys)
+static bool do_list_keys(const char *controller, const char *cgroup, struct cgm_keys ***keys)
 {
+	cgm_lock();
 	if (!cgm_dbus_connect()) {
+		cgm_unlock();
 		return false;
 	}
 
-	if ( cgmanager_list_keys_sync(NULL, cgroup_manager, controller, cgroup,
-				(CgmanagerListKeysOutputElement ***)keys) != 0 ) {
+	if ( cgm_timed(STATS_CGM_LIST_KEYS, cgroup, cgmanager_list_keys_sync(NULL, cgroup_manager, controller, cgroup,
+				(CgmanagerListKeysOutputElement ***)keys)) != 0 ) {
 		NihError *nerr;
 		nerr = nih_error_get();
 		fprintf(stderr, "call to list_keys (%s:%s) failed: %s\n", controller, cgroup, nerr->message);
 		nih_free(nerr);
 		cgm_dbus_disconnect();
+		cgm_unlock();
 		return false;
 	}
 
-	cgm_dbus_disconnect();
+	cgm_unlock();
 	return true;
 }
 
-bool cgm_list_children(const char *controller, const char *cgroup, char ***list)
+static bool do_list_children(const char *controller, const char *cgroup, char ***list)
 {
+	cgm_lock();
 	if (!cgm_dbus_connect()) {
+		cgm_unlock();
 		return false;
 	}
 
-	if ( cgmanager_list_children_sync(NULL, cgroup_manager, controller, cgroup, list) != 0 ) {
+	if ( cgm_timed(STATS_CGM_LIST_CHILDREN, cgroup, cgmanager_list_children_sync(NULL, cgroup_manager, controller, cgroup, list)) != 0 ) {
 		NihError *nerr;
 		nerr = nih_error_get();
 		fprintf(stderr, "call to list_children (%s:%s) failed: %s\n", controller, cgroup, nerr->message);
 		nih_free(nerr);
 		cgm_dbus_disconnect();
+		cgm_unlock();
 		return false;
 	}
 
-	cgm_dbus_disconnect();
+	cgm_unlock();
 	return true;
 }
 
@@ -169,101 +246,302 @@ char *cgm_get_pid_cgroup(pid_t pid, const char *controller)
 {
 	char *output = NULL;
 
+	cgm_lock();
 	if (!cgm_dbus_connect()) {
+		cgm_unlock();
 		return NULL;
 	}
 
-	if ( cgmanager_get_pid_cgroup_sync(NULL, cgroup_manager, controller, pid, &output) != 0 ) {
+	if ( cgm_timed(STATS_CGM_GET_PID_CGROUP, "", cgmanager_get_pid_cgroup_sync(NULL, cgroup_manager, controller, pid, &output)) != 0 ) {
 		NihError *nerr;
 		nerr = nih_error_get();
 		fprintf(stderr, "call to get_pid_cgroup (%s) failed: %s\n", controller, nerr->message);
 		nih_free(nerr);
 		cgm_dbus_disconnect();
+		cgm_unlock();
 		return NULL;
 	}
 
-	cgm_dbus_disconnect();
+	cgm_unlock();
 	return output;
 }
 
 bool cgm_escape_cgroup(void)
 {
+	cgm_lock();
 	if (!cgm_dbus_connect()) {
+		cgm_unlock();
 		return false;
 	}
 
-	if ( cgmanager_move_pid_abs_sync(NULL, cgroup_manager, "all", "/", (int32_t) getpid()) != 0 ) {
+	if ( cgm_timed(STATS_CGM_ESCAPE_CGROUP, "/", cgmanager_move_pid_abs_sync(NULL, cgroup_manager, "all", "/", (int32_t) getpid())) != 0 ) {
 		NihError *nerr;
 		nerr = nih_error_get();
 		fprintf(stderr, "call to move_pid_abs (all:/) failed: %s\n", nerr->message);
 		nih_free(nerr);
 		cgm_dbus_disconnect();
+		cgm_unlock();
 		return false;
 	}
 
-	cgm_dbus_disconnect();
+	cgm_unlock();
 	return true;
 }
 
 bool cgm_move_pid(const char *controller, const char *cgroup, pid_t pid)
 {
+	cgm_lock();
 	if (!cgm_dbus_connect()) {
+		cgm_unlock();
 		return false;
 	}
 
-	if ( cgmanager_move_pid_sync(NULL, cgroup_manager, controller, cgroup,
-				(int32_t) pid) != 0 ) {
+	if ( cgm_timed(STATS_CGM_MOVE_PID, cgroup, cgmanager_move_pid_sync(NULL, cgroup_manager, controller, cgroup,
+				(int32_t) pid)) != 0 ) {
 		NihError *nerr;
 		nerr = nih_error_get();
 		fprintf(stderr, "call to move_pid (%s:%s, %d) failed: %s\n", controller, cgroup, pid, nerr->message);
 		nih_free(nerr);
 		cgm_dbus_disconnect();
+		cgm_unlock();
 		return false;
 	}
 
-	cgm_dbus_disconnect();
+	cgm_unlock();
 	return true;
 }
 
-bool cgm_get_value(const char *controller, const char *cgroup, const char *file,
+static bool do_get_value(const char *controller, const char *cgroup, const char *file,
 		char **value)
 {
+	cgm_lock();
 	if (!cgm_dbus_connect()) {
+		cgm_unlock();
 		return false;
 	}
 
-	if ( cgmanager_get_value_sync(NULL, cgroup_manager, controller, cgroup,
-			file, value) != 0 ) {
+	if ( cgm_timed(STATS_CGM_GET_VALUE, cgroup, cgmanager_get_value_sync(NULL, cgroup_manager, controller, cgroup,
+			file, value)) != 0 ) {
 		NihError *nerr;
 		nerr = nih_error_get();
 		fprintf(stderr, "call to get_value (%s:%s, %s) failed: %s\n", controller, cgroup, file, nerr->message);
 		nih_free(nerr);
 		cgm_dbus_disconnect();
+		cgm_unlock();
 		return false;
 	}
 
-	cgm_dbus_disconnect();
+	cgm_unlock();
 	return true;
 }
 
+/*
+ * Identical list_keys, list_children and get_value calls made at the same
+ * time share one trip to cgmanager.  The first caller makes the call, the
+ * others wait for it to land, and each gets its own copy of the answer.
+ * So when a container's monitoring agents all read the same file at
+ * once, cgmanager sees one call per cgroup rather than one per reader.
+ */
+enum cgm_flight_type {
+	FLIGHT_LIST_KEYS,
+	FLIGHT_LIST_CHILDREN,
+	FLIGHT_GET_VALUE,
+};
+
+struct cgm_flight {
+	enum cgm_flight_type type;
+	const char *controller, *cgroup, *file;	/* the caller's, until it lands */
+	bool landed, ok;
+	void *result;		/* a copy for those waiting, child of the flight */
+	unsigned int refs;
+	struct cgm_flight *next;
+};
+
+static pthread_mutex_t flight_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flight_cond = PTHREAD_COND_INITIALIZER;
+static struct cgm_flight *flights;
+
+static char **copy_children(const void *parent, char **list)
+{
+	char **copy;
+	size_t len = 0;
+
+	copy = NIH_MUST( nih_str_array_new(parent) );
+	for (; *list; list++)
+		NIH_MUST( nih_str_array_add(&copy, parent, &len, *list) );
+	return copy;
+}
+
+static struct cgm_keys **copy_keys(const void *parent, struct cgm_keys **keys)
+{
+	struct cgm_keys **copy;
+	size_t i, n;
+
+	for (n = 0; keys[n]; n++)
+		;
+	copy = NIH_MUST( nih_alloc(parent, (n + 1) * sizeof(*copy)) );
+	for (i = 0; i < n; i++) {
+		copy[i] = NIH_MUST( nih_new(copy, struct cgm_keys) );
+		*copy[i] = *keys[i];
+		copy[i]->name = NIH_MUST( nih_strdup(copy[i], keys[i]->name) );
+	}
+	copy[n] = NULL;
+	return copy;
+}
+
+static void *flight_copy(enum cgm_flight_type type, const void *parent, void *result)
+{
+	switch (type) {
+	case FLIGHT_LIST_KEYS:
+		return copy_keys(parent, result);
+	case FLIGHT_LIST_CHILDREN:
+		return copy_children(parent, result);
+	case FLIGHT_GET_VALUE:
+		return NIH_MUST( nih_strdup(parent, result) );
+	}
+	return NULL;
+}
+
+/*
+ * Board the flight for this call.  Returns true if there was none, in
+ * which case we must make the call and land the flight.  Otherwise we
+ * return once the flight has landed.
+ */
+static bool flight_board(struct cgm_flight **fp, enum cgm_flight_type type,
+		const char *controller, const char *cgroup, const char *file)
+{
+	struct cgm_flight *f;
+
+	pthread_mutex_lock(&flight_lock);
+	for (f = flights; f; f = f->next) {
+		if (f->type == type && strcmp(f->controller, controller) == 0 &&
+				strcmp(f->cgroup, cgroup) == 0 &&
+				(!file || strcmp(f->file, file) == 0))
+			break;
+	}
+	if (f) {
+		f->refs++;
+		stats_inc(STATS_CGM_SHARED);
+		while (!f->landed)
+			pthread_cond_wait(&flight_cond, &flight_lock);
+		pthread_mutex_unlock(&flight_lock);
+		*fp = f;
+		return false;
+	}
+
+	f = NIH_MUST( nih_new(NULL, struct cgm_flight) );
+	memset(f, 0, sizeof(*f));
+	f->type = type;
+	f->controller = controller;
+	f->cgroup = cgroup;
+	f->file = file;
+	f->refs = 1;
+	f->next = flights;
+	flights = f;
+	pthread_mutex_unlock(&flight_lock);
+	*fp = f;
+	return true;
+}
+
+static void flight_leave(struct cgm_flight *f)
+{
+	bool last;
+
+	pthread_mutex_lock(&flight_lock);
+	last = --f->refs == 0;
+	pthread_mutex_unlock(&flight_lock);
+	if (last)
+		nih_free(f);
+}
+
+/* land with the answer to the call, which stays the caller's */
+static void flight_land(struct cgm_flight *f, bool ok, void *result)
+{
+	struct cgm_flight **fp;
+
+	pthread_mutex_lock(&flight_lock);
+	for (fp = &flights; *fp != f; fp = &(*fp)->next)
+		;
+	*fp = f->next;
+	f->ok = ok;
+	if (ok && f->refs > 1)
+		f->result = flight_copy(f->type, f, result);
+	f->controller = f->cgroup = f->file = NULL;
+	f->landed = true;
+	pthread_cond_broadcast(&flight_cond);
+	pthread_mutex_unlock(&flight_lock);
+	flight_leave(f);
+}
+
+/* what we got from someone else's flight */
+static bool flight_result(struct cgm_flight *f, void **result)
+{
+	bool ok = f->ok;
+
+	if (ok)
+		*result = flight_copy(f->type, NULL, f->result);
+	flight_leave(f);
+	return ok;
+}
+
+bool cgm_list_keys(const char *controller, const char *cgroup, struct cgm_keys ***keys)
+{
+	struct cgm_flight *f;
+	bool ok;
+
+	if (!flight_board(&f, FLIGHT_LIST_KEYS, controller, cgroup, NULL))
+		return flight_result(f, (void **)keys);
+	ok = do_list_keys(controller, cgroup, keys);
+	flight_land(f, ok, ok ? *keys : NULL);
+	return ok;
+}
+
+bool cgm_list_children(const char *controller, const char *cgroup, char ***list)
+{
+	struct cgm_flight *f;
+	bool ok;
+
+	if (!flight_board(&f, FLIGHT_LIST_CHILDREN, controller, cgroup, NULL))
+		return flight_result(f, (void **)list);
+	ok = do_list_children(controller, cgroup, list);
+	flight_land(f, ok, ok ? *list : NULL);
+	return ok;
+}
+
+bool cgm_get_value(const char *controller, const char *cgroup, const char *file,
+		char **value)
+{
+	struct cgm_flight *f;
+	bool ok;
+
+	if (!flight_board(&f, FLIGHT_GET_VALUE, controller, cgroup, file))
+		return flight_result(f, (void **)value);
+	ok = do_get_value(controller, cgroup, file, value);
+	flight_land(f, ok, ok ? *value : NULL);
+	return ok;
+}
+
 bool cgm_set_value(const char *controller, const char *cgroup, const char *file,
 		const char *value)
 {
+	cgm_lock();
 	if (!cgm_dbus_connect()) {
+		cgm_unlock();
 		return false;
 	}
 
-	if ( cgmanager_set_value_sync(NULL, cgroup_manager, controller, cgroup,
-			file, value) != 0 ) {
+	if ( cgm_timed(STATS_CGM_SET_VALUE, cgroup, cgmanager_set_value_sync(NULL, cgroup_manager, controller, cgroup,
+			file, value)) != 0 ) {
 		NihError *nerr;
 		nerr = nih_error_get();
 		fprintf(stderr, "call to set_value (%s:%s, %s, %s) failed: %s\n", controller, cgroup, file, value, nerr->message);
 		nih_free(nerr);
 		cgm_dbus_disconnect();
+		cgm_unlock();
 		return false;
 	}
 
-	cgm_dbus_disconnect();
+	cgm_unlock();
 	return true;
 }
 
@@ -288,14 +566,36 @@ again:
 bool cgm_create(const char *controller, const char *cg, uid_t uid, gid_t gid)
 {
 	int32_t e;
-	pid_t pid = fork();
+	uint64_t start = stats_now();
+	pid_t pid;
 
+	LXCFS_PROBE2(cgm__entry, "create", cg);
+	/*
+	 * The child talks D-Bus, so fork while no other thread can be
+	 * inside libdbus or libnih, holding locks the child would then
+	 * never see released.  Every call to them is made under cgm_mutex.
+	 */
+	cgm_lock();
+	pid = fork();
 	if (pid) {
-		if (wait_for_pid(pid) != 0)
-			return false;
-		return true;
+		bool ok;
+
+		cgm_unlock();
+		ok = pid > 0 && wait_for_pid(pid) == 0;
+
+		/* the call itself is made by the child */
+		LXCFS_PROBE3(cgm__return, "create", cg, ok ? 0 : -1);
+		stats_cgm(STATS_CGM_CREATE, start, ok);
+		return ok;
 	}
 
+	/*
+	 * We are the only thread in the child, and must not use (or take the
+	 * lock protecting, which we hold a copy of) the parent's connection.
+	 * Open our own, as the requested user.
+	 */
+	cgroup_manager = NULL;
+
 	if (setgroups(0, NULL))
 		exit(1);
 	if (setresgid(gid, gid, gid))
@@ -322,39 +622,45 @@ bool cgm_create(const char *controller, const char *cg, uid_t uid, gid_t gid)
 
 bool cgm_chown_file(const char *controller, const char *cg, uid_t uid, gid_t gid)
 {
+	cgm_lock();
 	if (!cgm_dbus_connect()) {
+		cgm_unlock();
 		return false;
 	}
 
-	if ( cgmanager_chown_sync(NULL, cgroup_manager, controller, cg, uid, gid) != 0) {
+	if ( cgm_timed(STATS_CGM_CHOWN_FILE, cg, cgmanager_chown_sync(NULL, cgroup_manager, controller, cg, uid, gid)) != 0) {
 		NihError *nerr;
 		nerr = nih_error_get();
 		fprintf(stderr, "call to chown (%s:%s, %d, %d) failed: %s\n", controller, cg, uid, gid, nerr->message);
 		nih_free(nerr);
 		cgm_dbus_disconnect();
+		cgm_unlock();
 		return false;
 	}
 
-	cgm_dbus_disconnect();
+	cgm_unlock();
 	return true;
 }
 
 bool cgm_chmod_file(const char *controller, const char *file, mode_t mode)
 {
+	cgm_lock();
 	if (!cgm_dbus_connect()) {
+		cgm_unlock();
 		return false;
 	}
 
-	if ( cgmanager_chmod_sync(NULL, cgroup_manager, controller, file, "", mode) != 0) {
+	if ( cgm_timed(STATS_CGM_CHMOD_FILE, file, cgmanager_chmod_sync(NULL, cgroup_manager, controller, file, "", mode)) != 0) {
 		NihError *nerr;
 		nerr = nih_error_get();
 		fprintf(stderr, "call to chmod (%s:%s, %d) failed: %s\n", controller, file, mode, nerr->message);
 		nih_free(nerr);
 		cgm_dbus_disconnect();
+		cgm_unlock();
 		return false;
 	}
 
-	cgm_dbus_disconnect();
+	cgm_unlock();
 	return true;
 }
 
@@ -366,19 +672,239 @@ bool cgm_remove(const char *controller, const char *cg)
 	 */
 	int32_t r = 0, e;
 
+	cgm_lock();
 	if (!cgm_dbus_connect()) {
+		cgm_unlock();
 		return false;
 	}
 
-	if ( cgmanager_remove_sync(NULL, cgroup_manager, controller, cg, r, &e) != 0) {
+	if ( cgm_timed(STATS_CGM_REMOVE, cg, cgmanager_remove_sync(NULL, cgroup_manager, controller, cg, r, &e)) != 0) {
 		NihError *nerr;
 		nerr = nih_error_get();
 		fprintf(stderr, "call to remove (%s:%s) failed: %s\n", controller, cg, nerr->message);
 		nih_free(nerr);
 		cgm_dbus_disconnect();
+		cgm_unlock();
 		return false;
 	}
 
-	cgm_dbus_disconnect();
+	cgm_unlock();
 	return true;
 }
+
+/*
+ * Batches of calls which are sent to cgmanager together and whose replies
+ * are then collected together, so that the batch costs one round trip
+ * rather than one per call.
+ *
+ * The results belong to the batch, and are freed along with it.  A result
+ * which is still NULL once the batch has run means that call failed.
+ * Calls queued after cgm_batch_quiet(b, true) fail without complaint,
+ * for lookups made speculatively.
+ */
+enum cgm_call_type {
+	CGM_CALL_LIST_KEYS,
+	CGM_CALL_LIST_CHILDREN,
+	CGM_CALL_GET_VALUE,
+};
+
+struct cgm_call {
+	struct cgm_batch *b;
+	enum cgm_call_type type;
+	char *controller, *cgroup, *file;
+	void **result;
+	bool quiet;
+	DBusPendingCall *pending;
+	struct cgm_call *next;
+};
+
+struct cgm_batch {
+	struct cgm_call *calls, **tail;
+	bool quiet, failed;
+	uint64_t start;
+};
+
+struct cgm_batch *cgm_batch_new(void)
+{
+	struct cgm_batch *b;
+
+	b = NIH_MUST( nih_new(NULL, struct cgm_batch) );
+	b->calls = NULL;
+	b->tail = &b->calls;
+	b->quiet = b->failed = false;
+	return b;
+}
+
+void cgm_batch_quiet(struct cgm_batch *b, bool quiet)
+{
+	b->quiet = quiet;
+}
+
+static void cgm_batch_add(struct cgm_batch *b, enum cgm_call_type type,
+		const char *controller, const char *cgroup, const char *file,
+		void **result)
+{
+	struct cgm_call *c;
+
+	c = NIH_MUST( nih_new(b, struct cgm_call) );
+	c->b = b;
+	c->type = type;
+	c->controller = NIH_MUST( nih_strdup(c, controller) );
+	c->cgroup = NIH_MUST( nih_strdup(c, cgroup) );
+	c->file = file ? NIH_MUST( nih_strdup(c, file) ) : NULL;
+	c->result = result;
+	*result = NULL;
+	c->quiet = b->quiet;
+	c->pending = NULL;
+	c->next = NULL;
+	*b->tail = c;
+	b->tail = &c->next;
+}
+
+void cgm_batch_list_keys(struct cgm_batch *b, const char *controller,
+		const char *cgroup, struct cgm_keys ***keys)
+{
+	cgm_batch_add(b, CGM_CALL_LIST_KEYS, controller, cgroup, NULL, (void **)keys);
+}
+
+void cgm_batch_list_children(struct cgm_batch *b, const char *controller,
+		const char *cgroup, char ***list)
+{
+	cgm_batch_add(b, CGM_CALL_LIST_CHILDREN, controller, cgroup, NULL, (void **)list);
+}
+
+void cgm_batch_get_value(struct cgm_batch *b, const char *controller,
+		const char *cgroup, const char *file, char **value)
+{
+	cgm_batch_add(b, CGM_CALL_GET_VALUE, controller, cgroup, file, (void **)value);
+}
+
+static const char *cgm_call_name(enum cgm_call_type type)
+{
+	switch (type) {
+	case CGM_CALL_LIST_KEYS: return "list_keys";
+	case CGM_CALL_LIST_CHILDREN: return "list_children";
+	case CGM_CALL_GET_VALUE: return "get_value";
+	}
+	return "unknown";
+}
+
+/* the result belongs to the reply message; keep it alive with the batch */
+static void cgm_batch_keep(struct cgm_call *c, const void *result)
+{
+	nih_ref(result, c->b);
+	*c->result = (void *) result;
+}
+
+static void cgm_batch_keys_reply(void *data, NihDBusMessage *message,
+		CgmanagerListKeysOutputElement * const *output)
+{
+	cgm_batch_keep(data, output);
+}
+
+static void cgm_batch_children_reply(void *data, NihDBusMessage *message,
+		char * const *output)
+{
+	cgm_batch_keep(data, output);
+}
+
+static void cgm_batch_value_reply(void *data, NihDBusMessage *message,
+		const char *value)
+{
+	cgm_batch_keep(data, value);
+}
+
+static void cgm_batch_error(void *data, NihDBusMessage *message)
+{
+	struct cgm_call *c = data;
+	NihError *nerr;
+
+	nerr = nih_error_get();
+	if (!c->quiet)
+		fprintf(stderr, "call to %s (%s:%s%s%s) failed: %s\n",
+			cgm_call_name(c->type), c->controller, c->cgroup,
+			c->file ? ", " : "", c->file ? c->file : "",
+			nerr->message);
+	nih_free(nerr);
+	if (!c->quiet)
+		c->b->failed = true;
+}
+
+/*
+ * Send all calls queued on the batch without waiting for any reply.  The
+ * cgmanager lock is held until cgm_batch_wait(), so keep the work done in
+ * between short and local.
+ */
+void cgm_batch_send(struct cgm_batch *b)
+{
+	struct cgm_call *c;
+
+	cgm_lock();
+	b->start = stats_now();
+	LXCFS_PROBE2(cgm__entry, "batch", b->calls ? b->calls->cgroup : "");
+	if (!cgm_dbus_connect()) {
+		b->failed = true;
+		return;
+	}
+
+	for (c = b->calls; c; c = c->next) {
+		switch (c->type) {
+		case CGM_CALL_LIST_KEYS:
+			c->pending = cgmanager_list_keys(cgroup_manager,
+					c->controller, c->cgroup,
+					cgm_batch_keys_reply, cgm_batch_error, c, -1);
+			break;
+		case CGM_CALL_LIST_CHILDREN:
+			c->pending = cgmanager_list_children(cgroup_manager,
+					c->controller, c->cgroup,
+					cgm_batch_children_reply, cgm_batch_error, c, -1);
+			break;
+		case CGM_CALL_GET_VALUE:
+			c->pending = cgmanager_get_value(cgroup_manager,
+					c->controller, c->cgroup, c->file,
+					cgm_batch_value_reply, cgm_batch_error, c, -1);
+			break;
+		}
+		if (!c->pending)
+			cgm_batch_error(c, NULL);
+	}
+}
+
+/*
+ * Wait for the replies to everything sent by cgm_batch_send().  Afterwards
+ * the batch is empty and may be reused.  Returns false if any call which
+ * was not quiet failed.
+ */
+bool cgm_batch_wait(struct cgm_batch *b)
+{
+	struct cgm_call *c;
+	bool ret;
+
+	for (c = b->calls; c; c = c->next) {
+		if (!c->pending)
+			continue;
+		dbus_pending_call_block(c->pending);
+		dbus_pending_call_unref(c->pending);
+		c->pending = NULL;
+	}
+	cgm_unlock();
+	LXCFS_PROBE3(cgm__return, "batch", b->calls ? b->calls->cgroup : "",
+			b->failed ? -1 : 0);
+	stats_cgm(STATS_CGM_BATCH, b->start, !b->failed);
+
+	/* the results stay with the batch, the calls can go */
+	while ((c = b->calls)) {
+		b->calls = c->next;
+		nih_free(c);
+	}
+	b->tail = &b->calls;
+	ret = !b->failed;
+	b->failed = false;
+	return ret;
+}
+
+bool cgm_batch_run(struct cgm_batch *b)
+{
+	cgm_batch_send(b);
+	return cgm_batch_wait(b);
+}
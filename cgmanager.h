@@ -4,6 +4,8 @@ struct cgm_keys {
 	uint32_t mode;
 };
 
+void cgm_init(void);
+void cgm_close(void);
 bool cgm_get_controllers(char ***contrls);
 bool cgm_list_keys(const char *controller, const char *cgroup, struct cgm_keys ***keys);
 bool cgm_list_children(const char *controller, const char *cgroup, char ***list);
@@ -19,3 +21,16 @@ bool cgm_remove(const char *controller, const char *cg);
 
 bool cgm_escape_cgroup(void);
 bool cgm_move_pid(const char *controller, const char *cgroup, pid_t pid);
+
+struct cgm_batch;
+struct cgm_batch *cgm_batch_new(void);
+void cgm_batch_list_keys(struct cgm_batch *b, const char *controller,
+		const char *cgroup, struct cgm_keys ***keys);
+void cgm_batch_list_children(struct cgm_batch *b, const char *controller,
+		const char *cgroup, char ***list);
+void cgm_batch_get_value(struct cgm_batch *b, const char *controller,
+		const char *cgroup, const char *file, char **value);
+void cgm_batch_quiet(struct cgm_batch *b, bool quiet);
+void cgm_batch_send(struct cgm_batch *b);
+bool cgm_batch_wait(struct cgm_batch *b);
+bool cgm_batch_run(struct cgm_batch *b);
@@ -0,0 +1,480 @@
+/* lxcfs
+ *
+ * Copyright © 2015 Canonical, Inc
+ *
+ * See COPYING file for details.
+ */
+
+/*
+ * Watch the host's cgroup hierarchies for changes made behind our back.
+ *
+ * Every cgroup directory of each hierarchy which holds a controller we
+ * serve gets an inotify watch.  When a cgroup is created or removed, or
+ * a file in it is written, chmodded or chowned, we bump its generation
+ * counter and that of its controller, and tell lxcfs through a callback
+ * what changed.
+ * Caches remember the generation they were filled at, and know they are
+ * stale when it has moved on.
+ *
+ * Generations only ever grow.  Counters for removed cgroups are kept, so
+ * that a cgroup which is re-created under the same name does not find
+ * the old cgroup's cache entries valid.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <sys/inotify.h>
+
+#include <nih/alloc.h>
+#include <nih/string.h>
+
+#include "cgwatch.h"
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+		IN_ATTRIB | IN_MODIFY | IN_ONLYDIR)
+
+/* a mounted hierarchy, and the (possibly co-mounted) controllers we serve from it */
+struct cg_hier {
+	char *mountpoint;
+	char **controllers;
+	size_t nr_controllers;
+	bool complete;		/* false once we failed to watch some cgroup */
+	struct cg_hier *next;
+};
+
+/* a watched cgroup directory */
+struct cg_watch {
+	int wd;
+	struct cg_hier *h;
+	char *cgroup;
+	struct cg_watch *next;
+};
+
+/* the generation of a cgroup, or of a whole controller if cgroup is NULL */
+struct cg_gen {
+	char *controller;
+	char *cgroup;
+	unsigned long gen;
+	struct cg_gen *next;
+};
+
+#define WATCH_HASH_SIZE 1024
+#define GEN_HASH_SIZE 1024
+#define GEN_LOCK_SHARDS 16
+
+static struct cg_hier *hiers;
+static struct cg_watch *watch_hash[WATCH_HASH_SIZE];
+static int inotify_fd = -1;
+static cgwatch_cb watch_cb;
+
+/*
+ * The generations are looked up by every request which uses a cache, so
+ * the table is split over several locks.  Bucket b is protected by
+ * gen_locks[b % GEN_LOCK_SHARDS].
+ */
+static struct cg_gen *gen_hash[GEN_HASH_SIZE];
+static pthread_mutex_t gen_locks[GEN_LOCK_SHARDS] = {
+	[0 ... GEN_LOCK_SHARDS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+static unsigned long gen_seq;
+/* bumped when the kernel dropped events, which makes every generation stale */
+static unsigned long gen_epoch;
+/* protects the complete flags of the hierarchies */
+static pthread_mutex_t hier_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * lxcfs names the root cgroup "/" and others either with or without
+ * a leading '/'.  Use the latter.
+ */
+static const char *norm_cgroup(const char *cg)
+{
+	while (*cg == '/')
+		cg++;
+	return *cg ? cg : "/";
+}
+
+static unsigned int gen_hashfn(const char *controller, const char *cgroup)
+{
+	unsigned int h = 5381;
+
+	while (*controller)
+		h = h * 33 + (unsigned char)*controller++;
+	if (cgroup) {
+		while (*cgroup)
+			h = h * 33 + (unsigned char)*cgroup++;
+	}
+	return h % GEN_HASH_SIZE;
+}
+
+static pthread_mutex_t *gen_lock(unsigned int h)
+{
+	return &gen_locks[h % GEN_LOCK_SHARDS];
+}
+
+/* called with gen_lock(h) held */
+static struct cg_gen *gen_find_locked(unsigned int h, const char *controller,
+		const char *cgroup, bool create)
+{
+	struct cg_gen *g;
+
+	for (g = gen_hash[h]; g; g = g->next) {
+		if (strcmp(g->controller, controller) != 0)
+			continue;
+		if (!cgroup && !g->cgroup)
+			return g;
+		if (cgroup && g->cgroup && strcmp(g->cgroup, cgroup) == 0)
+			return g;
+	}
+	if (!create)
+		return NULL;
+
+	g = NIH_MUST( nih_new(NULL, struct cg_gen) );
+	g->controller = NIH_MUST( nih_strdup(g, controller) );
+	g->cgroup = cgroup ? NIH_MUST( nih_strdup(g, cgroup) ) : NULL;
+	g->gen = 0;
+	g->next = gen_hash[h];
+	gen_hash[h] = g;
+	return g;
+}
+
+static void gen_set(const char *controller, const char *cgroup)
+{
+	unsigned int h = gen_hashfn(controller, cgroup);
+
+	pthread_mutex_lock(gen_lock(h));
+	gen_find_locked(h, controller, cgroup, true)->gen =
+		__sync_add_and_fetch(&gen_seq, 1);
+	pthread_mutex_unlock(gen_lock(h));
+}
+
+static unsigned long gen_get(const char *controller, const char *cgroup)
+{
+	unsigned int h = gen_hashfn(controller, cgroup);
+	struct cg_gen *g;
+	unsigned long gen;
+
+	pthread_mutex_lock(gen_lock(h));
+	g = gen_find_locked(h, controller, cgroup, false);
+	gen = g ? g->gen : 0;
+	pthread_mutex_unlock(gen_lock(h));
+	return gen + __sync_fetch_and_add(&gen_epoch, 0);
+}
+
+static void gen_bump(const char *controller, const char *cgroup)
+{
+	gen_set(controller, cgroup);
+	gen_set(controller, NULL);
+}
+
+/*
+ * Return the generation of cgroup.  Any change to the cgroup or its
+ * files makes this return a different value.
+ */
+unsigned long cgwatch_generation(const char *controller, const char *cgroup)
+{
+	return gen_get(controller, norm_cgroup(cgroup));
+}
+
+/*
+ * Return the generation of a controller, which changes whenever any
+ * cgroup in it does.
+ */
+unsigned long cgwatch_controller_generation(const char *controller)
+{
+	return gen_get(controller, NULL);
+}
+
+static struct cg_hier *find_hier(const char *controller)
+{
+	struct cg_hier *h;
+	size_t i;
+
+	for (h = hiers; h; h = h->next) {
+		for (i = 0; i < h->nr_controllers; i++) {
+			if (strcmp(h->controllers[i], controller) == 0)
+				return h;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Whether changes to controller's cgroups are being tracked.  If not,
+ * its generations will never change and callers must not rely on them.
+ */
+bool cgwatch_watching(const char *controller)
+{
+	struct cg_hier *h;
+	bool ret;
+
+	pthread_mutex_lock(&hier_lock);
+	h = find_hier(controller);
+	ret = h && h->complete;
+	pthread_mutex_unlock(&hier_lock);
+	return ret;
+}
+
+static struct cg_watch *watch_by_wd(int wd)
+{
+	struct cg_watch *w;
+
+	for (w = watch_hash[wd % WATCH_HASH_SIZE]; w; w = w->next) {
+		if (w->wd == wd)
+			return w;
+	}
+	return NULL;
+}
+
+static void watch_remove(struct cg_watch *w)
+{
+	struct cg_watch **wp;
+
+	for (wp = &watch_hash[w->wd % WATCH_HASH_SIZE]; *wp != w; wp = &(*wp)->next)
+		;
+	*wp = w->next;
+	nih_free(w);
+}
+
+static char *cgroup_join(const char *parent, const char *name)
+{
+	if (strcmp(parent, "/") == 0)
+		return NIH_MUST( nih_strdup(NULL, name) );
+	return NIH_MUST( nih_sprintf(NULL, "%s/%s", parent, name) );
+}
+
+/* watch cgroup and, recursively, all cgroups under it */
+static void watch_cgroup(struct cg_hier *h, const char *cgroup)
+{
+	nih_local char *path = NULL;
+	struct cg_watch *w;
+	struct dirent *dirent;
+	DIR *dir;
+	int wd;
+
+	if (strcmp(cgroup, "/") == 0)
+		path = NIH_MUST( nih_strdup(NULL, h->mountpoint) );
+	else
+		path = NIH_MUST( nih_sprintf(NULL, "%s/%s", h->mountpoint, cgroup) );
+
+	wd = inotify_add_watch(inotify_fd, path, WATCH_MASK);
+	if (wd < 0) {
+		if (errno != ENOENT) {
+			fprintf(stderr, "%s: failed to watch %s: %s\n", __func__,
+				path, strerror(errno));
+			pthread_mutex_lock(&hier_lock);
+			h->complete = false;
+			pthread_mutex_unlock(&hier_lock);
+		}
+		return;
+	}
+
+	w = watch_by_wd(wd);
+	if (!w) {
+		w = NIH_MUST( nih_new(NULL, struct cg_watch) );
+		w->wd = wd;
+		w->next = watch_hash[wd % WATCH_HASH_SIZE];
+		watch_hash[wd % WATCH_HASH_SIZE] = w;
+	} else
+		nih_free(w->cgroup);
+	w->h = h;
+	w->cgroup = NIH_MUST( nih_strdup(w, cgroup) );
+
+	if (!(dir = opendir(path)))
+		return;
+	while ((dirent = readdir(dir))) {
+		nih_local char *child = NULL;
+
+		if (dirent->d_type != DT_DIR)
+			continue;
+		if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+			continue;
+		child = cgroup_join(cgroup, dirent->d_name);
+		watch_cgroup(h, child);
+	}
+	closedir(dir);
+}
+
+static void cgroup_changed(struct cg_hier *h, const char *cgroup,
+		const char *name, enum cgwatch_change change)
+{
+	size_t i;
+
+	for (i = 0; i < h->nr_controllers; i++) {
+		gen_bump(h->controllers[i], cgroup);
+		if (watch_cb)
+			watch_cb(h->controllers[i], cgroup, name, change);
+	}
+}
+
+static void handle_event(struct inotify_event *ev)
+{
+	struct cg_watch *w;
+	struct cg_hier *h;
+	size_t i;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		/* we don't know what we missed */
+		__sync_add_and_fetch(&gen_epoch, 1);
+		for (h = hiers; h; h = h->next)
+			cgroup_changed(h, "/", NULL, CGWATCH_ALL);
+		return;
+	}
+
+	if (!(w = watch_by_wd(ev->wd)))
+		return;
+
+	if (ev->mask & IN_IGNORED) {
+		watch_remove(w);
+		return;
+	}
+
+	if (!ev->len) {
+		cgroup_changed(w->h, w->cgroup, NULL, CGWATCH_ATTRS);
+		return;
+	}
+	if (ev->mask & IN_ISDIR) {
+		nih_local char *child = cgroup_join(w->cgroup, ev->name);
+
+		if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+			watch_cgroup(w->h, child);
+		for (i = 0; i < w->h->nr_controllers; i++)
+			gen_bump(w->h->controllers[i], child);
+	}
+	if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+		cgroup_changed(w->h, w->cgroup, ev->name, CGWATCH_ENTRY);
+	else
+		cgroup_changed(w->h, w->cgroup, ev->name, CGWATCH_ATTRS);
+}
+
+static void *cgwatch_thread(void *arg)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	struct cg_hier *h;
+	sigset_t sigs;
+	ssize_t len;
+	char *p;
+
+	/* leave signals to the fuse loop */
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	for (;;) {
+		len = read(inotify_fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("cgwatch read");
+			break;
+		}
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *) p;
+			handle_event(ev);
+		}
+	}
+
+	/* from now on nobody can trust the generations */
+	pthread_mutex_lock(&hier_lock);
+	for (h = hiers; h; h = h->next)
+		h->complete = false;
+	pthread_mutex_unlock(&hier_lock);
+	return NULL;
+}
+
+static bool has_mntopt(const char *opts, const char *opt)
+{
+	size_t len = strlen(opt);
+	const char *p = opts;
+
+	while (p && *p) {
+		if (strncmp(p, opt, len) == 0 && (p[len] == ',' || p[len] == '\0'))
+			return true;
+		p = strchr(p, ',');
+		if (p)
+			p++;
+	}
+	return false;
+}
+
+/*
+ * Find where each controller's hierarchy is mounted, grouping co-mounted
+ * controllers together.  Controllers whose hierarchy we cannot see are
+ * simply not watched.
+ */
+static void find_hierarchies(char **controllers)
+{
+	FILE *f;
+	char *line = NULL;
+	size_t len = 0;
+	int i;
+
+	if (!(f = fopen("/proc/self/mounts", "r")))
+		return;
+
+	while (getline(&line, &len, f) != -1) {
+		char mnt[4096], fstype[64], opts[4096];
+		struct cg_hier *h = NULL;
+
+		if (sscanf(line, "%*s %4095s %63s %4095s", mnt, fstype, opts) != 3)
+			continue;
+		if (strcmp(fstype, "cgroup") != 0)
+			continue;
+		for (i = 0; controllers[i]; i++) {
+			if (!has_mntopt(opts, controllers[i]) || find_hier(controllers[i]))
+				continue;
+			if (!h) {
+				h = NIH_MUST( nih_new(NULL, struct cg_hier) );
+				h->mountpoint = NIH_MUST( nih_strdup(h, mnt) );
+				h->controllers = NIH_MUST( nih_str_array_new(h) );
+				h->nr_controllers = 0;
+				h->complete = true;
+				h->next = hiers;
+				hiers = h;
+			}
+			NIH_MUST( nih_str_array_add(&h->controllers, h,
+					&h->nr_controllers, controllers[i]) );
+		}
+	}
+	fclose(f);
+	free(line);
+}
+
+/*
+ * Start watching the hierarchies of @controllers, calling @cb from the
+ * watcher thread whenever a cgroup changes.
+ */
+bool cgwatch_start(char **controllers, cgwatch_cb cb)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	struct cg_hier *h;
+
+	inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (inotify_fd < 0) {
+		perror("inotify_init1");
+		return false;
+	}
+	watch_cb = cb;
+
+	find_hierarchies(controllers);
+	for (h = hiers; h; h = h->next)
+		watch_cgroup(h, "/");
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, cgwatch_thread, NULL) != 0) {
+		pthread_attr_destroy(&attr);
+		for (h = hiers; h; h = h->next)
+			h->complete = false;
+		return false;
+	}
+	pthread_attr_destroy(&attr);
+	return true;
+}
@@ -0,0 +1,18 @@
+/* what changed, see cgwatch_cb */
+enum cgwatch_change {
+	CGWATCH_ATTRS,	/* name, or cgroup itself if name is NULL, was written or chmodded */
+	CGWATCH_ENTRY,	/* name was created in cgroup, or removed from it */
+	CGWATCH_ALL,	/* we lost track, anything at or below cgroup may have changed */
+};
+
+/*
+ * Called from the watcher thread whenever something in cgroup changed
+ * behind our back.
+ */
+typedef void (*cgwatch_cb)(const char *controller, const char *cgroup,
+		const char *name, enum cgwatch_change change);
+
+bool cgwatch_start(char **controllers, cgwatch_cb cb);
+bool cgwatch_watching(const char *controller);
+unsigned long cgwatch_generation(const char *controller, const char *cgroup);
+unsigned long cgwatch_controller_generation(const char *controller);
@@ -0,0 +1,245 @@
+/* lxcfs
+ *
+ * Copyright © 2015 Canonical, Inc
+ *
+ * See COPYING file for details.
+ */
+
+/*
+ * Publishing what lxcfs shows containers in a file on the host, which
+ * agents can map and read without a single syscall.  See export.h for
+ * the layout.
+ *
+ * There is a single writer, the thread which refreshes the /proc views.
+ * It writes the records of the cgroups it refreshed in a round between
+ * export_round() and export_sweep(), which retires whatever was not
+ * written in that round.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <nih/alloc.h>
+#include <nih/string.h>
+
+#include "export.h"
+
+#define SLOT_HASH_SIZE 1024
+
+/* what we know about each record, which the readers need not see */
+struct export_slot {
+	char *cgroup;		/* NULL if the record is unused */
+	unsigned long round;	/* the last round it was written in */
+	uint32_t written;	/* the flags written in that round */
+	struct export_slot *next;	/* hash chain */
+};
+
+static struct export_header *export_map;
+static struct export_record *records;
+static struct export_slot slots[EXPORT_RECORDS];
+static struct export_slot *slot_hash[SLOT_HASH_SIZE];
+static unsigned long round;
+
+static unsigned int slot_hashfn(const char *cgroup)
+{
+	unsigned int h = 5381;
+
+	while (*cgroup)
+		h = h * 33 + (unsigned char)*cgroup++;
+	return h % SLOT_HASH_SIZE;
+}
+
+static struct export_record *slot_record(struct export_slot *s)
+{
+	return &records[s - slots];
+}
+
+static void record_lock(struct export_record *r)
+{
+	r->seq++;
+	__sync_synchronize();
+}
+
+static void record_unlock(struct export_record *r)
+{
+	__sync_synchronize();
+	r->seq++;
+}
+
+/*
+ * Create or reuse the file at path, readable by root only, and map it.
+ * A reader which still has the file mapped from an earlier lxcfs sees
+ * every record go unused, then fill up again.
+ */
+bool export_open(const char *path, double refresh)
+{
+	size_t size = sizeof(struct export_header) +
+			EXPORT_RECORDS * sizeof(struct export_record);
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	if (fchmod(fd, 0600) < 0 || ftruncate(fd, size) < 0) {
+		fprintf(stderr, "Failed to set up %s: %s\n", path, strerror(errno));
+		close(fd);
+		return false;
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Failed to map %s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	export_map = map;
+	records = (struct export_record *) (export_map + 1);
+	memset(map, 0, size);
+	export_map->version = EXPORT_VERSION;
+	export_map->nr_records = EXPORT_RECORDS;
+	export_map->record_size = sizeof(struct export_record);
+	export_map->refresh_ns = refresh * 1000000000;
+	__sync_synchronize();
+	export_map->magic = EXPORT_MAGIC;
+	return true;
+}
+
+bool export_enabled(void)
+{
+	return export_map != NULL;
+}
+
+void export_round(void)
+{
+	round++;
+}
+
+static struct export_slot *slot_find(const char *cgroup)
+{
+	struct export_slot *s;
+
+	for (s = slot_hash[slot_hashfn(cgroup)]; s; s = s->next) {
+		if (strcmp(s->cgroup, cgroup) == 0)
+			return s;
+	}
+	return NULL;
+}
+
+static struct export_slot *slot_new(const char *cgroup)
+{
+	struct export_record *r;
+	struct export_slot *s;
+	unsigned int h;
+
+	for (s = slots; s < slots + EXPORT_RECORDS; s++) {
+		if (!s->cgroup)
+			break;
+	}
+	if (s == slots + EXPORT_RECORDS)
+		return NULL;
+
+	s->cgroup = NIH_MUST( nih_strdup(NULL, cgroup) );
+	s->round = 0;
+	s->written = 0;
+	h = slot_hashfn(cgroup);
+	s->next = slot_hash[h];
+	slot_hash[h] = s;
+
+	r = slot_record(s);
+	record_lock(r);
+	memset((char *) r + sizeof(r->seq), 0, sizeof(*r) - sizeof(r->seq));
+	strcpy(r->cgroup, cgroup);
+	record_unlock(r);
+	return s;
+}
+
+static void slot_free(struct export_slot *s)
+{
+	struct export_slot **sp;
+
+	for (sp = &slot_hash[slot_hashfn(s->cgroup)]; *sp != s; sp = &(*sp)->next)
+		;
+	*sp = s->next;
+	nih_free(s->cgroup);
+	s->cgroup = NULL;
+}
+
+/*
+ * Whether the fields for flag have already been written for cgroup this
+ * round, so the caller need not fetch them again.
+ */
+bool export_written(const char *cgroup, uint32_t flag)
+{
+	struct export_slot *s = slot_find(cgroup);
+
+	return s && s->round == round && (s->written & flag);
+}
+
+/*
+ * Return the record for cgroup, locked for writing the fields for flag,
+ * or NULL if there is no room for it.
+ */
+struct export_record *export_begin(const char *cgroup, uint32_t flag)
+{
+	struct export_record *r;
+	struct export_slot *s;
+
+	if (strlen(cgroup) >= EXPORT_CGROUP_LEN)
+		return NULL;
+	s = slot_find(cgroup);
+	if (!s && !(s = slot_new(cgroup)))
+		return NULL;
+	if (s->round != round) {
+		s->round = round;
+		s->written = 0;
+	}
+	r = slot_record(s);
+	record_lock(r);
+	return r;
+}
+
+void export_end(struct export_record *r, uint32_t flag)
+{
+	struct export_slot *s = &slots[r - records];
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	s->written |= flag;
+	r->flags |= flag;
+	r->updated = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	record_unlock(r);
+}
+
+/* retire whatever was not written this round */
+void export_sweep(void)
+{
+	struct export_record *r;
+	struct export_slot *s;
+	uint32_t keep;
+
+	for (s = slots; s < slots + EXPORT_RECORDS; s++) {
+		if (!s->cgroup)
+			continue;
+		keep = s->round == round ? s->written : 0;
+		r = slot_record(s);
+		if ((r->flags & ~keep) == 0)
+			continue;
+		record_lock(r);
+		r->flags &= keep;
+		record_unlock(r);
+		if (!r->flags)
+			slot_free(s);
+	}
+}
@@ -0,0 +1,55 @@
+/*
+ * The layout of the file lxcfs -o export=PATH keeps up to date, so that
+ * monitoring agents on the host can read what lxcfs shows containers
+ * without going through fuse.
+ *
+ * The file is an export_header followed by nr_records export_records of
+ * record_size bytes each.  There is a record for each cgroup whose /proc
+ * files lxcfs keeps rendered in the background (see -o refresh), updated
+ * as often as those are; a record whose flags are 0 is unused.  Records
+ * are written under a seqlock, so read one as follows, and ignore it if
+ * it is unused:
+ *
+ *	do {
+ *		seq = r->seq;
+ *		__sync_synchronize();
+ *		copy = *r;
+ *		__sync_synchronize();
+ *	} while ((seq & 1) || seq != r->seq);
+ */
+#define EXPORT_MAGIC 0x6c786578	/* "lxex" */
+#define EXPORT_VERSION 1
+#define EXPORT_RECORDS 4096
+#define EXPORT_CPUSET_LEN 256
+#define EXPORT_CGROUP_LEN 256
+
+/* which fields of a record are valid */
+#define EXPORT_MEMORY	(1 << 0)
+#define EXPORT_CPUSET	(1 << 1)
+
+struct export_header {
+	uint32_t magic, version;
+	uint32_t nr_records, record_size;
+	uint64_t refresh_ns;	/* how often records are updated */
+	uint64_t reserved[5];
+};
+
+struct export_record {
+	uint32_t seq;		/* odd while the record is being written */
+	uint32_t flags;
+	uint64_t updated;	/* CLOCK_REALTIME, in ns */
+	/* EXPORT_MEMORY, in kB, as read from the memory cgroup */
+	uint64_t mem_limit, mem_usage, mem_cached;
+	/* EXPORT_CPUSET */
+	uint32_t nr_cpus, pad;
+	char cpuset[EXPORT_CPUSET_LEN];
+	char cgroup[EXPORT_CGROUP_LEN];
+};
+
+bool export_open(const char *path, double refresh);
+bool export_enabled(void);
+void export_round(void);
+bool export_written(const char *cgroup, uint32_t flag);
+struct export_record *export_begin(const char *cgroup, uint32_t flag);
+void export_end(struct export_record *r, uint32_t flag);
+void export_sweep(void);
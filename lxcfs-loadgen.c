@@ -0,0 +1,445 @@
+/* lxcfs
+ *
+ * Copyright © 2015 Canonical, Inc
+ *
+ * See COPYING file for details.
+ */
+
+/*
+ * lxcfs-loadgen: see how a mounted lxcfs holds up under many containers.
+ *
+ * Each simulated container is a process in its own user and pid
+ * namespaces, which reads files from the lxcfs mount in a loop for a
+ * while, picking each op at random from a weighted mix.  At the end we
+ * print latency percentiles for each op, and the ops per second served
+ * to all containers together.
+ *
+ * Each container also gets a cgroup of its own, made through the mount
+ * under our own memory cgroup, or the one given with -g, and removed
+ * again at the end.  The /cgroup ops look at the container's cgroup.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+enum {
+	OP_MEMINFO,
+	OP_STAT,
+	OP_UPTIME,
+	OP_TASKS,
+	OP_LS,
+	NR_OPS,
+};
+
+static const char *op_names[NR_OPS] = {
+	[OP_MEMINFO] = "meminfo",
+	[OP_STAT] = "stat",
+	[OP_UPTIME] = "uptime",
+	[OP_TASKS] = "tasks",
+	[OP_LS] = "ls",
+};
+
+static int op_weights[NR_OPS] = { 4, 2, 1, 1, 2 };
+
+/*
+ * Latencies in ns go into log-linear buckets: 16 per power of two, so
+ * percentiles come out within about 6%.
+ */
+#define SUB_BITS 4
+#define SUB (1 << SUB_BITS)
+#define NR_BUCKETS (48 * SUB)
+
+struct op_stats {
+	uint64_t count, errors;
+	uint64_t buckets[NR_BUCKETS];
+};
+
+struct container_stats {
+	struct op_stats ops[NR_OPS];
+};
+
+static char *mnt;
+static char *cgdir;
+static int duration = 10;
+static pid_t generator;
+
+static int bucket(uint64_t ns)
+{
+	int major;
+
+	if (ns < SUB)
+		return ns;
+	major = 63 - __builtin_clzll(ns);
+	if (major >= 48)
+		return NR_BUCKETS - 1;
+	return (major - SUB_BITS + 1) * SUB + ((ns >> (major - SUB_BITS)) & (SUB - 1));
+}
+
+/* the smallest latency which falls into bucket @b */
+static uint64_t bucket_ns(int b)
+{
+	int major = b / SUB + SUB_BITS - 1;
+
+	if (b < SUB)
+		return b;
+	return (1ULL << major) + ((uint64_t) (b % SUB) << (major - SUB_BITS));
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int read_file(const char *path)
+{
+	char buf[65536];
+	ssize_t n;
+	int fd, ret = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		;
+	if (n < 0)
+		ret = -1;
+	close(fd);
+	return ret;
+}
+
+/* what ls -l does: list the directory and stat everything in it */
+static int list_dir(const char *path)
+{
+	char p[PATH_MAX + NAME_MAX + 2];
+	struct dirent *de;
+	struct stat sb;
+	DIR *d;
+
+	d = opendir(path);
+	if (!d)
+		return -1;
+	while ((de = readdir(d))) {
+		snprintf(p, sizeof(p), "%s/%s", path, de->d_name);
+		lstat(p, &sb);
+	}
+	closedir(d);
+	return 0;
+}
+
+static int do_op(int op)
+{
+	char path[PATH_MAX];
+
+	switch (op) {
+	case OP_MEMINFO:
+		snprintf(path, sizeof(path), "%s/proc/meminfo", mnt);
+		return read_file(path);
+	case OP_STAT:
+		snprintf(path, sizeof(path), "%s/proc/stat", mnt);
+		return read_file(path);
+	case OP_UPTIME:
+		snprintf(path, sizeof(path), "%s/proc/uptime", mnt);
+		return read_file(path);
+	case OP_TASKS:
+		snprintf(path, sizeof(path), "%s/cgroup/%s/tasks", mnt, cgdir);
+		return read_file(path);
+	case OP_LS:
+		snprintf(path, sizeof(path), "%s/cgroup/%s", mnt, cgdir);
+		return list_dir(path);
+	}
+	return -1;
+}
+
+static int pick_op(int total)
+{
+	int r = random() % total, op;
+
+	for (op = 0; op < NR_OPS; op++) {
+		if (r < op_weights[op])
+			return op;
+		r -= op_weights[op];
+	}
+	return NR_OPS - 1;
+}
+
+static void run_container(struct container_stats *st, int id)
+{
+	uint64_t start, end;
+	int op, total = 0, ret;
+
+	for (op = 0; op < NR_OPS; op++)
+		total += op_weights[op];
+	srandom(getpid() ^ id);
+
+	end = now_ns() + (uint64_t) duration * 1000000000;
+	while ((start = now_ns()) < end) {
+		op = pick_op(total);
+		ret = do_op(op);
+		st->ops[op].buckets[bucket(now_ns() - start)]++;
+		st->ops[op].count++;
+		if (ret < 0)
+			st->ops[op].errors++;
+	}
+}
+
+static bool write_file(const char *path, const char *s)
+{
+	int fd = open(path, O_WRONLY);
+	bool ret;
+
+	if (fd < 0)
+		return false;
+	ret = write(fd, s, strlen(s)) == strlen(s);
+	close(fd);
+	return ret;
+}
+
+/* the cgroup of container @id, under mountpoint/cgroup */
+static char *container_cgroup(int id)
+{
+	char *cg;
+
+	if (asprintf(&cg, "%s/lxcfs-loadgen-%d-%d", cgdir, generator, id) < 0)
+		return NULL;
+	return cg;
+}
+
+/*
+ * Become a container: move into a cgroup of our own, map our uid and gid
+ * to root in a new user namespace, then fork the pid 1 of a new pid
+ * namespace, which does the work.
+ */
+static void container(struct container_stats *st, int id)
+{
+	char map[100], path[PATH_MAX];
+	uid_t uid = getuid();
+	gid_t gid = getgid();
+	pid_t pid;
+
+	if (!(cgdir = container_cgroup(id)))
+		exit(1);
+	snprintf(path, sizeof(path), "%s/cgroup/%s", mnt, cgdir);
+	if (mkdir(path, 0755) < 0) {
+		perror(path);
+		exit(1);
+	}
+	snprintf(path, sizeof(path), "%s/cgroup/%s/tasks", mnt, cgdir);
+	snprintf(map, sizeof(map), "%d", getpid());
+	if (!write_file(path, map)) {
+		perror(path);
+		exit(1);
+	}
+
+	if (unshare(CLONE_NEWUSER | CLONE_NEWPID) < 0) {
+		perror("unshare");
+		exit(1);
+	}
+	snprintf(map, sizeof(map), "0 %d 1", uid);
+	if (!write_file("/proc/self/uid_map", map))
+		exit(1);
+	write_file("/proc/self/setgroups", "deny");
+	snprintf(map, sizeof(map), "0 %d 1", gid);
+	if (!write_file("/proc/self/gid_map", map))
+		exit(1);
+
+	pid = fork();
+	if (pid < 0)
+		exit(1);
+	if (!pid) {
+		run_container(st, id);
+		exit(0);
+	}
+	if (waitpid(pid, NULL, 0) < 0)
+		exit(1);
+	exit(0);
+}
+
+static double percentile(struct op_stats *s, double p)
+{
+	uint64_t want = s->count * p, seen = 0;
+	int b;
+
+	for (b = 0; b < NR_BUCKETS; b++) {
+		seen += s->buckets[b];
+		if (seen > want)
+			return bucket_ns(b) / 1000.0;
+	}
+	return 0;
+}
+
+/* the cgroup we are in for @controller, without its leading '/' */
+static char *own_cgroup(const char *controller)
+{
+	char *line = NULL, *c1, *c2, *answer = NULL;
+	size_t len = 0;
+	FILE *f;
+
+	if (!(f = fopen("/proc/self/cgroup", "r")))
+		return NULL;
+	while (getline(&line, &len, f) != -1) {
+		c1 = strchr(line, ':');
+		if (!c1 || !(c2 = strchr(++c1, ':')))
+			continue;
+		*c2++ = '\0';
+		if (strcmp(c1, controller) != 0)
+			continue;
+		c2[strcspn(c2, "\n")] = '\0';
+		while (*c2 == '/')
+			c2++;
+		if (asprintf(&answer, "%s%s%s", controller, *c2 ? "/" : "", c2) < 0)
+			answer = NULL;
+		break;
+	}
+	fclose(f);
+	free(line);
+	return answer;
+}
+
+static bool parse_mix(char *mix)
+{
+	char *tok, *eq;
+	int op;
+
+	memset(op_weights, 0, sizeof(op_weights));
+	for (tok = strtok(mix, ","); tok; tok = strtok(NULL, ",")) {
+		if (!(eq = strchr(tok, '=')))
+			return false;
+		*eq = '\0';
+		for (op = 0; op < NR_OPS; op++) {
+			if (strcmp(op_names[op], tok) == 0)
+				break;
+		}
+		if (op == NR_OPS)
+			return false;
+		op_weights[op] = atoi(eq + 1);
+		if (op_weights[op] < 0)
+			return false;
+	}
+	for (op = 0; op < NR_OPS; op++) {
+		if (op_weights[op] > 0)
+			return true;
+	}
+	return false;
+}
+
+static void usage(const char *me)
+{
+	fprintf(stderr, "Usage: %s [-n containers] [-t seconds] [-x op=weight,...] [-g controller/cgroup] mountpoint\n\n", me);
+	fprintf(stderr, "  ops are meminfo, stat, uptime, tasks and ls (default meminfo=4,stat=2,uptime=1,tasks=1,ls=2)\n");
+	fprintf(stderr, "  -g   the cgroup under mountpoint/cgroup to make the containers' cgroups in (default our own memory cgroup)\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct container_stats *stats;
+	struct op_stats total[NR_OPS];
+	uint64_t start, ops = 0;
+	int containers = 10, c, i, op, b;
+	char path[PATH_MAX], *cg;
+	double secs;
+	pid_t pid;
+
+	while ((c = getopt(argc, argv, "n:t:x:g:h")) != -1) {
+		switch (c) {
+		case 'n':
+			containers = atoi(optarg);
+			break;
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'x':
+			if (!parse_mix(optarg))
+				usage(argv[0]);
+			break;
+		case 'g':
+			cgdir = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || containers < 1 || duration < 1)
+		usage(argv[0]);
+	mnt = argv[optind];
+	if (!cgdir && !(cgdir = own_cgroup("memory"))) {
+		fprintf(stderr, "Not in a memory cgroup, pass -g\n");
+		return 1;
+	}
+
+	stats = mmap(NULL, containers * sizeof(*stats), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (stats == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	generator = getpid();
+	start = now_ns();
+	for (i = 0; i < containers; i++) {
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			break;
+		}
+		if (!pid)
+			container(&stats[i], i);
+	}
+	while (wait(NULL) > 0 || errno == EINTR)
+		;
+	secs = (now_ns() - start) / 1e9;
+
+	/* the containers are all gone, and with them their tasks */
+	for (i = 0; i < containers; i++) {
+		if (!(cg = container_cgroup(i)))
+			continue;
+		snprintf(path, sizeof(path), "%s/cgroup/%s", mnt, cg);
+		if (rmdir(path) < 0 && errno != ENOENT)
+			perror(path);
+		free(cg);
+	}
+
+	memset(total, 0, sizeof(total));
+	for (i = 0; i < containers; i++) {
+		for (op = 0; op < NR_OPS; op++) {
+			total[op].count += stats[i].ops[op].count;
+			total[op].errors += stats[i].ops[op].errors;
+			for (b = 0; b < NR_BUCKETS; b++)
+				total[op].buckets[b] += stats[i].ops[op].buckets[b];
+		}
+	}
+
+	printf("%-8s %10s %8s %10s %10s %10s\n", "op", "count", "errors",
+		"p50 us", "p99 us", "p999 us");
+	for (op = 0; op < NR_OPS; op++) {
+		if (!total[op].count)
+			continue;
+		printf("%-8s %10llu %8llu %10.1f %10.1f %10.1f\n", op_names[op],
+			(unsigned long long) total[op].count,
+			(unsigned long long) total[op].errors,
+			percentile(&total[op], 0.50),
+			percentile(&total[op], 0.99),
+			percentile(&total[op], 0.999));
+		ops += total[op].count;
+	}
+	printf("%d containers, %.1f s, %.0f ops/s\n", containers, secs, ops / secs);
+	return 0;
+}
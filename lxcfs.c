@@ -7,24 +7,34 @@
  */
 
 /*
- * NOTES - make sure to run this as -s to avoid threading.
- * TODO - can we enforce that here from the code?
+ * NOTES - requests are served by a pool of worker threads (-o threads=N),
+ * or by the main thread alone with -s.  Anything shared between requests
+ * must be locked; per-request state lives in __thread variables.
  */
 #define FUSE_USE_VERSION 26
 
+#include "config.h"
+
 #include <stdio.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 #include <string.h>
 #include <stdlib.h>
 #include <libgen.h>
 #include <sched.h>
+#include <signal.h>
+#include <pthread.h>
 #include <linux/sched.h>
+#include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/mount.h>
 #include <wait.h>
@@ -33,6 +43,11 @@
 #include <nih/string.h>
 
 #include "cgmanager.h"
+#include "cgwatch.h"
+#include "stats.h"
+#include "probes.h"
+#include "upgrade.h"
+#include "export.h"
 
 struct lxcfs_state {
 	/*
@@ -40,8 +55,63 @@ struct lxcfs_state {
 	 * detect this at startup.
 	 */
 	char **subsystems;
+	/*
+	 * how long the kernel may cache lookups and attributes under
+	 * /cgroup.  We invalidate them ourselves when we know they changed.
+	 */
+	double cg_timeout;
+	/* number of worker threads, when not running with -s */
+	unsigned int threads;
+	/* our end of the socket to the lxcfs we are taking over from, or -1 */
+	int upgrade_fd;
+	/* seconds between re-rendering the /proc files read lately, 0 for never */
+	double refresh;
+	/* where to publish the numbers behind them, see export.h */
+	char *export_path;
+	/* whether to show only as many cpus as the CFS quota is worth */
+	int cpu_quota;
+};
+
+/*
+ * We run on the fuse lowlevel API, which hands each request its own
+ * credentials.  The lowlevel ops stash those here before calling into
+ * the path-based ops, which get at them through lxcfs_get_context().
+ */
+static __thread struct fuse_context lxcfs_ctx;
+
+static struct fuse_context *lxcfs_get_context(void)
+{
+	return &lxcfs_ctx;
+}
+#define LXCFS_DATA ((struct lxcfs_state *) lxcfs_get_context()->private_data)
+
+/*
+ * Paths whose cached dentries and attributes the current request has
+ * made stale.  The kernel holds locks on the parent directory while it
+ * waits for our reply to mkdir and friends, so these are only sent once
+ * the request has been answered.
+ */
+struct lxcfs_inval {
+	char *path;
+	bool tree;
+	struct lxcfs_inval *next;
 };
-#define LXCFS_DATA ((struct lxcfs_state *) fuse_get_context()->private_data)
+static __thread struct lxcfs_inval *lxcfs_pending_inval;
+
+/*
+ * Ask the kernel to forget the attributes of path.  If tree is true, also
+ * drop the dentry for path and the attributes of everything under it.
+ */
+static void lxcfs_invalidate(const char *path, bool tree)
+{
+	struct lxcfs_inval *i;
+
+	i = NIH_MUST( nih_new(NULL, struct lxcfs_inval) );
+	i->path = NIH_MUST( nih_strdup(i, path) );
+	i->tree = tree;
+	i->next = lxcfs_pending_inval;
+	lxcfs_pending_inval = i;
+}
 
 /*
  * TODO - return value should denote whether child exited with failure
@@ -210,35 +280,45 @@ static char *get_next_cgroup_dir(const char *taskcg, const char *querycg)
  * cgroup, because cgmanager doesn't tell us ownership/perms of cgroups
  * yet.
  */
+static bool fc_may_access_key(struct fuse_context *fc, struct cgm_keys *k, mode_t mode)
+{
+	if (is_privileged_over(fc->pid, fc->uid, k->uid, NS_ROOT_OPT)) {
+		if (perms_include(k->mode >> 6, mode))
+			return true;
+	}
+	if (fc->gid == k->gid) {
+		if (perms_include(k->mode >> 3, mode))
+			return true;
+	}
+	return perms_include(k->mode, mode);
+}
+
+static struct cgm_keys *find_key(struct cgm_keys **list, const char *f)
+{
+	int i;
+
+	if (*f == '/')
+		f++;
+	for (i = 0; list[i]; i++) {
+		if (strcmp(list[i]->name, f) == 0)
+			return list[i];
+	}
+	return NULL;
+}
+
 static bool fc_may_access(struct fuse_context *fc, const char *contrl, const char *cg, const char *file, mode_t mode)
 {
 	nih_local struct cgm_keys **list = NULL;
-	int i;
+	struct cgm_keys *k;
 
 	if (!file)
 		file = "tasks";
 
-	if (*file == '/')
-		file++;
-
 	if (!cgm_list_keys(contrl, cg, &list))
 		return false;
-	for (i = 0; list[i]; i++) {
-		if (strcmp(list[i]->name, file) == 0) {
-			struct cgm_keys *k = list[i];
-			if (is_privileged_over(fc->pid, fc->uid, k->uid, NS_ROOT_OPT)) {
-				if (perms_include(k->mode >> 6, mode))
-					return true;
-			}
-			if (fc->gid == k->gid) {
-				if (perms_include(k->mode >> 3, mode))
-					return true;
-			}
-			return perms_include(k->mode, mode);
-		}
-	}
-
-	return false;
+	if (!(k = find_key(list, file)))
+		return false;
+	return fc_may_access_key(fc, k, mode);
 }
 
 static void stripnewline(char *x)
@@ -352,26 +432,31 @@ static const char *find_cgroup_in_path(const char *path)
 	return p1+1;
 }
 
-static bool is_child_cgroup(const char *contr, const char *dir, const char *f)
+static bool list_contains(char **list, const char *f)
 {
-	nih_local char **list = NULL;
 	int i;
 
-	if (!f)
-		return false;
 	if (*f == '/')
 		f++;
-
-	if (!cgm_list_children(contr, dir, &list))
-		return false;
 	for (i = 0; list[i]; i++) {
 		if (strcmp(list[i], f) == 0)
 			return true;
 	}
-
 	return false;
 }
 
+static bool is_child_cgroup(const char *contr, const char *dir, const char *f)
+{
+	nih_local char **list = NULL;
+
+	if (!f)
+		return false;
+
+	if (!cgm_list_children(contr, dir, &list))
+		return false;
+	return list_contains(list, f);
+}
+
 static struct cgm_keys *get_cgroup_key(const char *contr, const char *dir, const char *f)
 {
 	nih_local struct cgm_keys **list = NULL;
@@ -412,31 +497,126 @@ static void get_cgdir_and_path(const char *cg, char **dir, char **file)
 	*p = '\0';
 }
 
-static size_t get_file_size(const char *contrl, const char *cg, const char *f)
+/*
+ * Open files and directories whose contents we build once and then hand
+ * out piecewise.  The kernel's fi->fh is a number looked up here rather
+ * than a pointer, so that the handles can be passed on in an upgrade.
+ */
+struct lxcfs_handle {
+	uint64_t fh;
+	char *buf;		/* nih_alloc'd child of the handle */
+	size_t size;
+	bool filled;
+	struct lxcfs_handle *next;
+};
+
+#define HANDLE_HASH_SIZE 256
+static struct lxcfs_handle *handle_hash[HANDLE_HASH_SIZE];
+static uint64_t next_fh = 1;
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct lxcfs_handle *handle_insert_locked(uint64_t fh)
 {
-	nih_local char *data = NULL;
-	size_t s;
-	if (!cgm_get_value(contrl, cg, f, &data))
-		return -EINVAL;
-	s = strlen(data);
-	return s;
+	struct lxcfs_handle *h;
+
+	h = NIH_MUST( nih_new(NULL, struct lxcfs_handle) );
+	memset(h, 0, sizeof(*h));
+	h->fh = fh;
+	h->next = handle_hash[fh % HANDLE_HASH_SIZE];
+	handle_hash[fh % HANDLE_HASH_SIZE] = h;
+	return h;
+}
+
+static struct lxcfs_handle *handle_new(void)
+{
+	struct lxcfs_handle *h;
+
+	pthread_mutex_lock(&handle_lock);
+	h = handle_insert_locked(next_fh++);
+	pthread_mutex_unlock(&handle_lock);
+	return h;
+}
+
+/*
+ * The kernel only releases a handle once nothing else is using it, so
+ * we can hand it out without holding the lock.
+ */
+static struct lxcfs_handle *handle_get(uint64_t fh)
+{
+	struct lxcfs_handle *h;
+
+	pthread_mutex_lock(&handle_lock);
+	for (h = handle_hash[fh % HANDLE_HASH_SIZE]; h; h = h->next) {
+		if (h->fh == fh)
+			break;
+	}
+	pthread_mutex_unlock(&handle_lock);
+	return h;
+}
+
+/* read from a handle filled at open */
+static int handle_read(uint64_t fh, char *buf, size_t size, off_t offset)
+{
+	struct lxcfs_handle *h = handle_get(fh);
+
+	if (!h)
+		return -EBADF;
+	if (offset >= h->size)
+		return 0;
+	if (size > h->size - offset)
+		size = h->size - offset;
+	memcpy(buf, h->buf + offset, size);
+	return size;
+}
+
+static void handle_free(uint64_t fh)
+{
+	struct lxcfs_handle *h, **hp;
+
+	pthread_mutex_lock(&handle_lock);
+	for (hp = &handle_hash[fh % HANDLE_HASH_SIZE]; (h = *hp); hp = &h->next) {
+		if (h->fh == fh) {
+			*hp = h->next;
+			nih_free(h);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&handle_lock);
 }
 
 /*
  * FUSE ops for /cgroup
  */
 
+#define CG_NOMINAL_SIZE 4096
+
+/*
+ * Each cgroup directory has a hidden file holding all the keys the
+ * caller may read, with their values, so that tools which snapshot a
+ * cgroup need a single open and read rather than one of each per key.
+ * It is not listed by readdir.
+ */
+#define CG_BUNDLE ".lxcfs.bundle"
+
+static bool is_bundle(const char *f)
+{
+	if (*f == '/')
+		f++;
+	return strcmp(f, CG_BUNDLE) == 0;
+}
+
 static int cg_getattr(const char *path, struct stat *sb)
 {
 	struct timespec now;
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	nih_local char * cgdir = NULL;
 	char *fpath = NULL, *path1, *path2;
-	nih_local struct cgm_keys *k = NULL;
+	nih_local struct cgm_batch *b = NULL;
+	char **children;
+	struct cgm_keys **keys, **cgkeys, *k;
 	const char *cgroup;
 	nih_local char *controller = NULL;
 
-
 	if (!fc)
 		return -EIO;
 
@@ -476,45 +656,55 @@ static int cg_getattr(const char *path, struct stat *sb)
 		path2 = fpath;
 	}
 
-	/* check that cgcopy is either a child cgroup of cgdir, or listed in its keys.
-	 * Then check that caller's cgroup is under path if fpath is a child
-	 * cgroup, or cgdir if fpath is a file */
-
-	if (is_child_cgroup(controller, path1, path2)) {
-		if (!caller_is_in_ancestor(fc->pid, controller, cgroup, NULL)) {
-			/* this is just /cgroup/controller, return it as a dir */
-			sb->st_mode = S_IFDIR | 00555;
-			sb->st_nlink = 2;
-			return 0;
-		}
-		if (!fc_may_access(fc, controller, cgroup, NULL, O_RDONLY))
-			return -EACCES;
+	if (is_bundle(path2)) {
+		sb->st_mode = S_IFREG | 00444;
+		sb->st_nlink = 1;
+		sb->st_size = CG_NOMINAL_SIZE;
+		return 0;
+	}
 
+	/*
+	 * The kernel caches what we answer here for everyone, so it must
+	 * not depend on who asked.  Whether the caller may see into the
+	 * cgroup is checked again by open, opendir, readdir and the ops
+	 * which change a cgroup, and default_permissions enforces the
+	 * modes below.
+	 *
+	 * We don't know yet whether path2 is a child cgroup of path1 or one
+	 * of its keys, so ask cgmanager everything either answer needs in a
+	 * single round trip.  The lookups which only make sense for one of
+	 * the two answers are expected to fail for the other. */
+
+	b = cgm_batch_new();
+	cgm_batch_list_children(b, controller, path1, &children);
+	cgm_batch_list_keys(b, controller, path1, &keys);
+	cgm_batch_quiet(b, true);
+	cgm_batch_list_keys(b, controller, cgroup, &cgkeys);
+	cgm_batch_run(b);
+
+	if (children && list_contains(children, path2)) {
 		// get uid, gid, from '/tasks' file and make up a mode
 		// That is a hack, until cgmanager gains a GetCgroupPerms fn.
 		sb->st_mode = S_IFDIR | 00755;
-		k = get_cgroup_key(controller, cgroup, "tasks");
-		if (!k) {
-			sb->st_uid = sb->st_gid = 0;
-		} else {
+		sb->st_nlink = 2;
+		if (cgkeys && (k = find_key(cgkeys, "tasks")) != NULL) {
 			sb->st_uid = k->uid;
 			sb->st_gid = k->gid;
 		}
-		sb->st_nlink = 2;
 		return 0;
 	}
 
-	if ((k = get_cgroup_key(controller, path1, path2)) != NULL) {
-		if (!caller_is_in_ancestor(fc->pid, controller, path1, NULL))
-			return -ENOENT;
-		if (!fc_may_access(fc, controller, path1, path2, O_RDONLY))
-			return -EACCES;
-
+	if (keys && (k = find_key(keys, path2)) != NULL) {
 		sb->st_mode = S_IFREG | k->mode;
 		sb->st_nlink = 1;
 		sb->st_uid = k->uid;
 		sb->st_gid = k->gid;
-		sb->st_size = get_file_size(controller, path1, path2);
+		/*
+		 * Finding out the real size would mean fetching the whole
+		 * value.  cg_open asks for direct_io, so the kernel doesn't
+		 * go by the size anyway.
+		 */
+		sb->st_size = CG_NOMINAL_SIZE;
 		return 0;
 	}
 
@@ -527,7 +717,7 @@ static int cg_getattr(const char *path, struct stat *sb)
  */
 static int cg_opendir(const char *path, struct fuse_file_info *fi)
 {
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	nih_local struct cgm_keys **list = NULL;
 	const char *cgroup;
 	nih_local char *controller = NULL;
@@ -558,7 +748,7 @@ static int cg_opendir(const char *path, struct fuse_file_info *fi)
 static int cg_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
 		struct fuse_file_info *fi)
 {
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 
 	if (!fc)
 		return -EIO;
@@ -637,48 +827,6 @@ static int cg_releasedir(const char *path, struct fuse_file_info *fi)
 	return 0;
 }
 
-/*
- * TODO - cache info here for read/write, release in cg_release.
- */
-static int cg_open(const char *path, struct fuse_file_info *fi)
-{
-	nih_local char *controller = NULL;
-	const char *cgroup;
-	char *fpath = NULL, *path1, *path2;
-	nih_local char * cgdir = NULL;
-	nih_local struct cgm_keys *k = NULL;
-	struct fuse_context *fc = fuse_get_context();
-
-	if (!fc)
-		return -EIO;
-
-	controller = pick_controller_from_path(fc, path);
-	if (!controller)
-		return -EIO;
-	cgroup = find_cgroup_in_path(path);
-	if (!cgroup)
-		return -EINVAL;
-
-	get_cgdir_and_path(cgroup, &cgdir, &fpath);
-	if (!fpath) {
-		path1 = "/";
-		path2 = cgdir;
-	} else {
-		path1 = cgdir;
-		path2 = fpath;
-	}
-
-	if ((k = get_cgroup_key(controller, path1, path2)) != NULL) {
-		if (!fc_may_access(fc, controller, path1, path2, fi->flags))
-			// should never get here
-			return -EACCES;
-
-		return 0;
-	}
-
-	return -EINVAL;
-}
-
 static int msgrecv(int sockfd, void *buf, size_t len)
 {
 	struct timeval tv;
@@ -883,12 +1031,14 @@ static bool do_read_pids(pid_t tpid, const char *contrl, const char *cg, const c
 		exit(1);
 	}
 
+	stats_inc(STATS_FORK_PID);
 	cpid = fork();
 	if (cpid == -1)
 		goto out;
 
 	if (!cpid) // child
 		pid_to_ns_wrapper(sock[1], tpid);
+	LXCFS_PROBE3(helper__fork, "pid_to_ns", tpid, cpid);
 
 	char *ptr = tmpdata;
 	cred.uid = 0;
@@ -936,8 +1086,10 @@ next:
 	answer = true;
 
 out:
-	if (cpid != -1)
-		wait_for_pid(cpid);
+	if (cpid != -1) {
+		ret = wait_for_pid(cpid);
+		LXCFS_PROBE3(helper__exit, "pid_to_ns", cpid, ret);
+	}
 	if (sock[0] != -1) {
 		close(sock[0]);
 		close(sock[1]);
@@ -945,25 +1097,137 @@ out:
 	return answer;
 }
 
-static int cg_read(const char *path, char *buf, size_t size, off_t offset,
-		struct fuse_file_info *fi)
+static bool is_pids_file(const char *f)
+{
+	if (*f == '/')
+		f++;
+	return strcmp(f, "tasks") == 0 || strcmp(f, "cgroup.procs") == 0;
+}
+
+/*
+ * The contents of CG_BUNDLE for cg: for each key the caller may read, a
+ * line "<name> <length>", then the value and a newline.  Everything but
+ * the pids is fetched from cgmanager in one round trip.
+ */
+static char *cg_bundle_render(const void *parent, struct fuse_context *fc,
+		const char *controller, const char *cg)
+{
+	nih_local struct cgm_keys **keys = NULL;
+	nih_local struct cgm_batch *b = NULL;
+	nih_local char **values = NULL;
+	nih_local bool *readable = NULL;
+	char *out;
+	size_t n, i;
+
+	if (!cgm_list_keys(controller, cg, &keys))
+		return NULL;
+	for (n = 0; keys[n]; n++)
+		;
+	values = NIH_MUST( nih_alloc(NULL, (n + 1) * sizeof(char *)) );
+	memset(values, 0, (n + 1) * sizeof(char *));
+	readable = NIH_MUST( nih_alloc(NULL, (n + 1) * sizeof(bool)) );
+
+	b = cgm_batch_new();
+	/* a key whose mode says it is readable may still refuse to be read */
+	cgm_batch_quiet(b, true);
+	for (i = 0; i < n; i++) {
+		readable[i] = fc_may_access_key(fc, keys[i], O_RDONLY);
+		if (readable[i] && !is_pids_file(keys[i]->name))
+			cgm_batch_get_value(b, controller, cg, keys[i]->name, &values[i]);
+	}
+	cgm_batch_run(b);
+
+	out = NIH_MUST( nih_strdup(parent, "") );
+	for (i = 0; i < n; i++) {
+		nih_local char *pids = NULL;
+		const char *v = values[i];
+
+		if (!readable[i])
+			continue;
+		if (is_pids_file(keys[i]->name)) {
+			if (!do_read_pids(fc->pid, controller, cg, keys[i]->name, &pids))
+				continue;
+			v = pids ? pids : "";
+		}
+		if (!v)
+			continue;
+		NIH_MUST( nih_strcat_sprintf(&out, parent, "%s %zu\n%s\n",
+				keys[i]->name, strlen(v), v) );
+	}
+	return out;
+}
+
+/*
+ * CG_BUNDLE is rendered once at open, so that reading it in several
+ * chunks gives a consistent snapshot.
+ */
+static int cg_bundle_open(struct fuse_context *fc, const char *controller,
+		const char *cg, struct fuse_file_info *fi)
+{
+	struct lxcfs_handle *h;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+	if (!caller_is_in_ancestor(fc->pid, controller, cg, NULL))
+		return -ENOENT;
+	if (!fc_may_access(fc, controller, cg, NULL, O_RDONLY))
+		return -EACCES;
+
+	h = handle_new();
+	h->buf = cg_bundle_render(h, fc, controller, cg);
+	if (!h->buf) {
+		handle_free(h->fh);
+		return -EINVAL;
+	}
+	h->size = strlen(h->buf);
+	h->filled = true;
+	fi->fh = h->fh;
+	fi->direct_io = 1;
+	return 0;
+}
+
+/*
+ * The value of a key, as the caller should read it, or NULL if it could
+ * not be read.
+ */
+static char *cg_value(const void *parent, struct fuse_context *fc,
+		const char *controller, const char *cg, const char *file)
+{
+	nih_local char *data = NULL;
+	bool r;
+
+	if (is_pids_file(file))
+		// special case - we have to translate the pids
+		r = do_read_pids(fc->pid, controller, cg, file, &data);
+	else
+		r = cgm_get_value(controller, cg, file, &data);
+	if (!r)
+		return NULL;
+	return NIH_MUST( nih_strdup(parent, data ? data : "") );
+}
+
+/*
+ * Our st_size is made up (see cg_getattr), so the kernel reads on until
+ * we return 0.  A key opened for reading is read once at open, and the
+ * reads are served from that, so that they see one consistent value
+ * however they are chunked.
+ */
+static int cg_open(const char *path, struct fuse_file_info *fi)
 {
 	nih_local char *controller = NULL;
 	const char *cgroup;
 	char *fpath = NULL, *path1, *path2;
-	struct fuse_context *fc = fuse_get_context();
 	nih_local char * cgdir = NULL;
 	nih_local struct cgm_keys *k = NULL;
-
-	if (offset)
-		return -EIO;
+	struct fuse_context *fc = lxcfs_get_context();
+	struct lxcfs_handle *h;
 
 	if (!fc)
 		return -EIO;
 
 	controller = pick_controller_from_path(fc, path);
 	if (!controller)
-		return -EINVAL;
+		return -EIO;
 	cgroup = find_cgroup_in_path(path);
 	if (!cgroup)
 		return -EINVAL;
@@ -977,48 +1241,109 @@ static int cg_read(const char *path, char *buf, size_t size, off_t offset,
 		path2 = fpath;
 	}
 
-	if ((k = get_cgroup_key(controller, path1, path2)) != NULL) {
-		nih_local char *data = NULL;
-		int s;
-		bool r;
+	if (is_bundle(path2))
+		return cg_bundle_open(fc, controller, path1, fi);
 
-		if (!fc_may_access(fc, controller, path1, path2, O_RDONLY))
-			// should never get here
+	if ((k = get_cgroup_key(controller, path1, path2)) != NULL) {
+		/*
+		 * cg_getattr answers the same whoever asks, so whether this
+		 * caller may see into the cgroup is up to us.
+		 */
+		if (!caller_is_in_ancestor(fc->pid, controller, path1, NULL))
+			return -ENOENT;
+		if (!fc_may_access(fc, controller, path1, path2, fi->flags))
 			return -EACCES;
 
-		if (strcmp(path2, "tasks") == 0 ||
-				strcmp(path2, "/tasks") == 0 ||
-				strcmp(path2, "/cgroup.procs") == 0 ||
-				strcmp(path2, "cgroup.procs") == 0)
-			// special case - we have to translate the pids
-			r = do_read_pids(fc->pid, controller, path1, path2, &data);
-		else
-			r = cgm_get_value(controller, path1, path2, &data);
-
-		if (!r)
-			return -EINVAL;
-
-		if (!data)
+		fi->direct_io = 1;
+		if ((fi->flags & O_ACCMODE) == O_WRONLY)
 			return 0;
-		s = strlen(data);
-		if (s > size)
-			s = size;
-		memcpy(buf, data, s);
-
-		return s;
+		h = handle_new();
+		h->buf = cg_value(h, fc, controller, path1, path2);
+		if (!h->buf) {
+			handle_free(h->fh);
+			return -EINVAL;
+		}
+		h->size = strlen(h->buf);
+		h->filled = true;
+		fi->fh = h->fh;
+		return 0;
 	}
 
 	return -EINVAL;
 }
 
-static void pid_from_ns(int sock, pid_t tpid)
+static int cg_read(const char *path, char *buf, size_t size, off_t offset,
+		struct fuse_file_info *fi)
 {
-	pid_t vpid;
-	struct ucred cred;
-	char v;
-
-	cred.uid = 0;
-	cred.gid = 0;
+	nih_local char *controller = NULL;
+	const char *cgroup;
+	char *fpath = NULL, *path1, *path2;
+	struct fuse_context *fc = lxcfs_get_context();
+	nih_local char * cgdir = NULL;
+	nih_local struct cgm_keys *k = NULL;
+
+	if (fi->fh)
+		return handle_read(fi->fh, buf, size, offset);
+
+	/* opened by an lxcfs from before values were read at open */
+	if (offset)
+		return 0;
+
+	if (!fc)
+		return -EIO;
+
+	controller = pick_controller_from_path(fc, path);
+	if (!controller)
+		return -EINVAL;
+	cgroup = find_cgroup_in_path(path);
+	if (!cgroup)
+		return -EINVAL;
+
+	get_cgdir_and_path(cgroup, &cgdir, &fpath);
+	if (!fpath) {
+		path1 = "/";
+		path2 = cgdir;
+	} else {
+		path1 = cgdir;
+		path2 = fpath;
+	}
+
+	if ((k = get_cgroup_key(controller, path1, path2)) != NULL) {
+		nih_local char *data = NULL;
+		int s;
+
+		if (!fc_may_access(fc, controller, path1, path2, O_RDONLY))
+			// should never get here
+			return -EACCES;
+
+		if (!(data = cg_value(NULL, fc, controller, path1, path2)))
+			return -EINVAL;
+		s = strlen(data);
+		if (s > size)
+			s = size;
+		memcpy(buf, data, s);
+
+		return s;
+	}
+
+	return -EINVAL;
+}
+
+static int cg_release(const char *path, struct fuse_file_info *fi)
+{
+	if (fi->fh)
+		handle_free(fi->fh);
+	return 0;
+}
+
+static void pid_from_ns(int sock, pid_t tpid)
+{
+	pid_t vpid;
+	struct ucred cred;
+	char v;
+
+	cred.uid = 0;
+	cred.gid = 0;
 	while (read(sock, &vpid, sizeof(pid_t)) == sizeof(pid_t)) {
 		if (vpid == -1) // done
 			break;
@@ -1061,7 +1386,7 @@ static void pid_from_ns_wrapper(int sock, pid_t tpid)
 
 static bool do_write_pids(pid_t tpid, const char *contrl, const char *cg, const char *file, const char *buf)
 {
-	int sock[2] = {-1, -1};
+	int sock[2] = {-1, -1}, ret;
 	pid_t qpid, cpid = -1;
 	bool answer = false, fail = false;
 
@@ -1074,12 +1399,14 @@ static bool do_write_pids(pid_t tpid, const char *contrl, const char *cg, const
 		exit(1);
 	}
 
+	stats_inc(STATS_FORK_PID);
 	cpid = fork();
 	if (cpid == -1)
 		goto out;
 
 	if (!cpid) // child
 		pid_from_ns_wrapper(sock[1], tpid);
+	LXCFS_PROBE3(helper__fork, "pid_from_ns", tpid, cpid);
 
 	const char *ptr = buf;
 	while (sscanf(ptr, "%d", &qpid) == 1) {
@@ -1114,8 +1441,10 @@ static bool do_write_pids(pid_t tpid, const char *contrl, const char *cg, const
 		answer = true;
 
 out:
-	if (cpid != -1)
-		wait_for_pid(cpid);
+	if (cpid != -1) {
+		ret = wait_for_pid(cpid);
+		LXCFS_PROBE3(helper__exit, "pid_from_ns", cpid, ret);
+	}
 	if (sock[0] != -1) {
 		close(sock[0]);
 		close(sock[1]);
@@ -1129,7 +1458,7 @@ int cg_write(const char *path, const char *buf, size_t size, off_t offset,
 	nih_local char *controller = NULL;
 	const char *cgroup;
 	char *fpath = NULL, *path1, *path2;
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	nih_local char * cgdir = NULL;
 	nih_local struct cgm_keys *k = NULL;
 
@@ -1161,10 +1490,7 @@ int cg_write(const char *path, const char *buf, size_t size, off_t offset,
 		if (!fc_may_access(fc, controller, path1, path2, O_WRONLY))
 			return -EACCES;
 
-		if (strcmp(path2, "tasks") == 0 ||
-				strcmp(path2, "/tasks") == 0 ||
-				strcmp(path2, "/cgroup.procs") == 0 ||
-				strcmp(path2, "cgroup.procs") == 0)
+		if (is_pids_file(path2))
 			// special case - we have to translate the pids
 			r = do_write_pids(fc->pid, controller, path1, path2, buf);
 		else
@@ -1181,7 +1507,7 @@ int cg_write(const char *path, const char *buf, size_t size, off_t offset,
 
 int cg_chown(const char *path, uid_t uid, gid_t gid)
 {
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	nih_local char * cgdir = NULL;
 	char *fpath = NULL, *path1, *path2;
 	nih_local struct cgm_keys *k = NULL;
@@ -1213,13 +1539,19 @@ int cg_chown(const char *path, uid_t uid, gid_t gid)
 		path2 = fpath;
 	}
 
+	/* cg_getattr shows every cgroup to everyone, so check here */
 	if (is_child_cgroup(controller, path1, path2)) {
+		if (!caller_is_in_ancestor(fc->pid, controller, cgroup, NULL))
+			return -EPERM;
 		// get uid, gid, from '/tasks' file and make up a mode
 		// That is a hack, until cgmanager gains a GetCgroupPerms fn.
 		k = get_cgroup_key(controller, cgroup, "tasks");
 
-	} else
+	} else {
+		if (!caller_is_in_ancestor(fc->pid, controller, path1, NULL))
+			return -ENOENT;
 		k = get_cgroup_key(controller, path1, path2);
+	}
 
 	if (!k)
 		return -EINVAL;
@@ -1235,12 +1567,13 @@ int cg_chown(const char *path, uid_t uid, gid_t gid)
 
 	if (!cgm_chown_file(controller, cgroup, uid, gid))
 		return -EINVAL;
+	lxcfs_invalidate(path, true);
 	return 0;
 }
 
 int cg_chmod(const char *path, mode_t mode)
 {
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	nih_local char * cgdir = NULL;
 	char *fpath = NULL, *path1, *path2;
 	nih_local struct cgm_keys *k = NULL;
@@ -1271,13 +1604,19 @@ int cg_chmod(const char *path, mode_t mode)
 		path2 = fpath;
 	}
 
+	/* cg_getattr shows every cgroup to everyone, so check here */
 	if (is_child_cgroup(controller, path1, path2)) {
+		if (!caller_is_in_ancestor(fc->pid, controller, cgroup, NULL))
+			return -EPERM;
 		// get uid, gid, from '/tasks' file and make up a mode
 		// That is a hack, until cgmanager gains a GetCgroupPerms fn.
 		k = get_cgroup_key(controller, cgroup, "tasks");
 
-	} else
+	} else {
+		if (!caller_is_in_ancestor(fc->pid, controller, path1, NULL))
+			return -ENOENT;
 		k = get_cgroup_key(controller, path1, path2);
+	}
 
 	if (!k)
 		return -EINVAL;
@@ -1293,15 +1632,17 @@ int cg_chmod(const char *path, mode_t mode)
 
 	if (!cgm_chmod_file(controller, cgroup, mode))
 		return -EINVAL;
+	lxcfs_invalidate(path, true);
 	return 0;
 }
 
 int cg_mkdir(const char *path, mode_t mode)
 {
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	nih_local struct cgm_keys **list = NULL;
 	char *fpath = NULL, *path1;
 	nih_local char * cgdir = NULL;
+	nih_local char *parent = NULL;
 	const char *cgroup;
 	nih_local char *controller = NULL;
 
@@ -1330,12 +1671,16 @@ int cg_mkdir(const char *path, mode_t mode)
 	if (!cgm_create(controller, cgroup, fc->uid, fc->gid))
 		return -EINVAL;
 
+	/* the new directory's own entry comes back in our reply */
+	parent = NIH_MUST( nih_strdup(NULL, path) );
+	*strrchr(parent, '/') = '\0';
+	lxcfs_invalidate(parent, false);
 	return 0;
 }
 
 static int cg_rmdir(const char *path)
 {
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	nih_local struct cgm_keys **list = NULL;
 	char *fpath = NULL;
 	nih_local char * cgdir = NULL;
@@ -1364,6 +1709,7 @@ static int cg_rmdir(const char *path)
 	if (!cgm_remove(controller, cgroup))
 		return -EINVAL;
 
+	lxcfs_invalidate(path, true);
 	return 0;
 }
 
@@ -1374,22 +1720,23 @@ static bool startswith(const char *line, const char *pref)
 	return false;
 }
 
-static void get_mem_cached(char *memstat, unsigned long *v)
+/* the value of key in memory.stat, in kB */
+static bool get_memstat(const char *memstat, const char *key, unsigned long *v)
 {
-	char *eol;
+	size_t len = strlen(key);
+	const char *eol;
 
-	*v = 0;
 	while (*memstat) {
-		if (startswith(memstat, "total_cache")) {
-			sscanf(memstat + 11, "%lu", v);
-			*v /= 1024;
-			return;
+		if (strncmp(memstat, key, len) == 0 && memstat[len] == ' ') {
+			*v = strtoul(memstat + len + 1, NULL, 10) / 1024;
+			return true;
 		}
 		eol = strchr(memstat, '\n');
 		if (!eol)
-			return;
+			return false;
 		memstat = eol+1;
 	}
+	return false;
 }
 
 static char *get_pid_cgroup(pid_t pid, const char *contrl)
@@ -1434,34 +1781,104 @@ out:
  * FUSE ops for /proc
  */
 
-static int proc_meminfo_read(char *buf, size_t size, off_t offset,
-		struct fuse_file_info *fi)
+/* what meminfo and swaps are made of, in kB */
+struct mem_values {
+	unsigned long limit, usage, cached;
+	/* of memory and swap together, 0 if swap is not accounted */
+	unsigned long memsw_limit, memsw_usage;
+};
+
+/*
+ * What a renderer run by the view refresher fetched, so that the export
+ * publishes the very numbers the view shows without asking cgmanager
+ * for them again.  Set around the render, on the refresher thread only.
+ */
+struct view_numbers {
+	uint32_t flags;		/* EXPORT_MEMORY and EXPORT_CPUSET */
+	struct mem_values mem;
+	char cpuset[EXPORT_CPUSET_LEN];
+};
+
+static __thread struct view_numbers *view_numbers;
+
+/*
+ * Fetch the numbers of memory cgroup cg in one round trip.  The memsw
+ * files are only there if the kernel accounts swap.
+ *
+ * A container may well put its tasks in a child cgroup with no limit of
+ * its own.  With use_hierarchy, the kernel enforces the tightest limit
+ * of the cgroup and its ancestors, and memory.stat already says which
+ * that is, so we need not walk up the hierarchy ourselves.
+ */
+static bool get_mem_values(const char *cg, struct mem_values *m)
+{
+	nih_local struct cgm_batch *b = NULL;
+	char *limit, *usage, *stat, *memsw_limit, *memsw_usage;
+	unsigned long hier;
+
+	b = cgm_batch_new();
+	cgm_batch_get_value(b, "memory", cg, "memory.limit_in_bytes", &limit);
+	cgm_batch_get_value(b, "memory", cg, "memory.usage_in_bytes", &usage);
+	cgm_batch_get_value(b, "memory", cg, "memory.stat", &stat);
+	cgm_batch_quiet(b, true);
+	cgm_batch_get_value(b, "memory", cg, "memory.memsw.limit_in_bytes", &memsw_limit);
+	cgm_batch_get_value(b, "memory", cg, "memory.memsw.usage_in_bytes", &memsw_usage);
+	if (!cgm_batch_run(b))
+		return false;
+
+	m->limit = strtoul(limit, NULL, 10) / 1024;
+	m->usage = strtoul(usage, NULL, 10) / 1024;
+	if (!get_memstat(stat, "total_cache", &m->cached))
+		m->cached = 0;
+	if (get_memstat(stat, "hierarchical_memory_limit", &hier) && hier < m->limit)
+		m->limit = hier;
+	m->memsw_limit = m->memsw_usage = 0;
+	if (memsw_limit && memsw_usage) {
+		m->memsw_limit = strtoul(memsw_limit, NULL, 10) / 1024;
+		m->memsw_usage = strtoul(memsw_usage, NULL, 10) / 1024;
+		if (get_memstat(stat, "hierarchical_memsw_limit", &hier) &&
+				hier < m->memsw_limit)
+			m->memsw_limit = hier;
+	}
+	/* the kernel keeps memsw at or above the memory limit */
+	if (m->memsw_limit < m->limit)
+		m->memsw_limit = m->memsw_usage = 0;
+	if (view_numbers) {
+		view_numbers->mem = *m;
+		view_numbers->flags |= EXPORT_MEMORY;
+	}
+	return true;
+}
+
+/*
+ * The swap the cgroup may use, which is what memsw allows beyond the
+ * memory limit but no more than the host has, and what it uses.  Returns
+ * false if swap is not accounted, and the host's numbers apply.
+ */
+static bool get_swap(const struct mem_values *m, unsigned long hostmem,
+		unsigned long hostswap, unsigned long *total, unsigned long *used)
+{
+	if (!m->memsw_limit)
+		return false;
+	*total = MIN(m->memsw_limit - MIN(m->limit, hostmem), hostswap);
+	*used = m->memsw_usage > m->usage ? m->memsw_usage - m->usage : 0;
+	*used = MIN(*used, *total);
+	return true;
+}
+
+static int proc_meminfo_read(struct fuse_context *fc, const char *cg,
+		char *buf, size_t size)
 {
-	struct fuse_context *fc = fuse_get_context();
-	nih_local char *cg = get_pid_cgroup(fc->pid, "memory");
-	nih_local char *memlimit_str = NULL, *memusage_str = NULL, *memstat_str = NULL;
-	unsigned long memlimit = 0, memusage = 0, cached = 0, hosttotal = 0;
+	struct mem_values m;
+	unsigned long memlimit, hosttotal = 0, hostswap = 0, swtotal = 0, swused = 0;
 	char *line = NULL;
 	size_t linelen = 0, total_len = 0;
+	bool swap = false;
 	FILE *f;
 
-	if (offset)
-		return -EINVAL;
-
-	if (!cg)
-		return 0;
-
-	if (!cgm_get_value("memory", cg, "memory.limit_in_bytes", &memlimit_str))
-		return 0;
-	if (!cgm_get_value("memory", cg, "memory.usage_in_bytes", &memusage_str))
+	if (!get_mem_values(cg, &m))
 		return 0;
-	if (!cgm_get_value("memory", cg, "memory.stat", &memstat_str))
-		return 0;
-	memlimit = strtoul(memlimit_str, NULL, 10);
-	memusage = strtoul(memusage_str, NULL, 10);
-	memlimit /= 1024;
-	memusage /= 1024;
-	get_mem_cached(memstat_str, &cached);
+	memlimit = m.limit;
 
 	f = fopen("/proc/meminfo", "r");
 	if (!f)
@@ -1479,20 +1896,28 @@ static int proc_meminfo_read(char *buf, size_t size, off_t offset,
 			snprintf(lbuf, 100, "MemTotal:       %8lu kB\n", memlimit);
 			printme = lbuf;
 		} else if (startswith(line, "MemFree:")) {
-			snprintf(lbuf, 100, "MemFree:        %8lu kB\n", memlimit - memusage);
+			snprintf(lbuf, 100, "MemFree:        %8lu kB\n", memlimit - m.usage);
 			printme = lbuf;
 		} else if (startswith(line, "MemAvailable:")) {
-			snprintf(lbuf, 100, "MemAvailable:   %8lu kB\n", memlimit - memusage);
+			snprintf(lbuf, 100, "MemAvailable:   %8lu kB\n", memlimit - m.usage);
 			printme = lbuf;
 		} else if (startswith(line, "Buffers:")) {
 			snprintf(lbuf, 100, "Buffers:        %8lu kB\n", 0UL);
 			printme = lbuf;
 		} else if (startswith(line, "Cached:")) {
-			snprintf(lbuf, 100, "Cached:         %8lu kB\n", cached);
+			snprintf(lbuf, 100, "Cached:         %8lu kB\n", m.cached);
 			printme = lbuf;
 		} else if (startswith(line, "SwapCached:")) {
 			snprintf(lbuf, 100, "SwapCached:     %8lu kB\n", 0UL);
 			printme = lbuf;
+		} else if (startswith(line, "SwapTotal:") &&
+				sscanf(line, "SwapTotal: %lu", &hostswap) == 1 &&
+				(swap = get_swap(&m, hosttotal, hostswap, &swtotal, &swused))) {
+			snprintf(lbuf, 100, "SwapTotal:      %8lu kB\n", swtotal);
+			printme = lbuf;
+		} else if (startswith(line, "SwapFree:") && swap) {
+			snprintf(lbuf, 100, "SwapFree:       %8lu kB\n", swtotal - swused);
+			printme = lbuf;
 		} else
 			printme = line;
 		l = snprintf(buf, size, "%s", printme);
@@ -1501,9 +1926,55 @@ static int proc_meminfo_read(char *buf, size_t size, off_t offset,
 		total_len += l;
 	}
 
+	fclose(f);
+	free(line);
 	return total_len;
 }
 
+/*
+ * /proc/swaps shows the swap the cgroup may use as a single device, or
+ * the host's devices if swap is not accounted.
+ */
+static int proc_swaps_read(struct fuse_context *fc, const char *cg,
+		char *buf, size_t size)
+{
+	struct mem_values m;
+	unsigned long hosttotal = 0, hostswap = 0, total, used;
+	nih_local char *out = NULL;
+	char *line = NULL;
+	size_t linelen = 0, len;
+	FILE *f;
+
+	if (!get_mem_values(cg, &m))
+		return 0;
+	if (!(f = fopen("/proc/meminfo", "r")))
+		return 0;
+	while (getline(&line, &linelen, f) != -1) {
+		sscanf(line, "MemTotal: %lu", &hosttotal);
+		sscanf(line, "SwapTotal: %lu", &hostswap);
+	}
+	fclose(f);
+
+	if (get_swap(&m, hosttotal, hostswap, &total, &used)) {
+		out = NIH_MUST( nih_strdup(NULL, "Filename\t\t\t\tType\t\tSize\tUsed\tPriority\n") );
+		if (total)
+			NIH_MUST( nih_strcat_sprintf(&out, NULL,
+				"none%*svirtual\t\t%lu\t%lu\t0\n", 36, "", total, used) );
+	} else if ((f = fopen("/proc/swaps", "r"))) {
+		out = NIH_MUST( nih_strdup(NULL, "") );
+		while (getline(&line, &linelen, f) != -1)
+			NIH_MUST( nih_strcat(&out, NULL, line) );
+		fclose(f);
+	}
+	free(line);
+	if (!out)
+		return 0;
+
+	len = MIN(strlen(out), size);
+	memcpy(buf, out, len);
+	return len;
+}
+
 /*
  * Read the cpuset.cpus for cg
  * Return the answer in a nih_alloced string
@@ -1514,6 +1985,11 @@ static char *get_cpuset(const char *cg)
 
 	if (!cgm_get_value("cpuset", cg, "cpuset.cpus", &answer))
 		return NULL;
+	if (view_numbers && strlen(answer) < EXPORT_CPUSET_LEN) {
+		strcpy(view_numbers->cpuset, answer);
+		stripnewline(view_numbers->cpuset);
+		view_numbers->flags |= EXPORT_CPUSET;
+	}
 	return answer;
 }
 
@@ -1559,6 +2035,161 @@ static bool cpu_in_cpuset(int cpu, const char *cpuset)
 	return false;
 }
 
+/* the number of cpus in cpuset */
+static int cpuset_nr_cpus(const char *cpuset)
+{
+	const char *c;
+	int a, b, n = 0;
+
+	for (c = cpuset; c; c = cpuset_nexttok(c)) {
+		switch (cpuset_getrange(c, &a, &b)) {
+		case 1:
+			n++;
+			break;
+		case 2:
+			if (b >= a)
+				n += b - a + 1;
+			break;
+		default:
+			return n;
+		}
+	}
+	return n;
+}
+
+static unsigned int str_hash(const char *s)
+{
+	unsigned int h = 5381;
+
+	while (*s)
+		h = h * 33 + (unsigned char)*s++;
+	return h;
+}
+
+/*
+ * Numbers derived from a cgroup's files, such as how many cpus its
+ * cpuset holds, good for as long as the cgroup's generation does not
+ * change.  Only kept while we are watching the controller for changes.
+ * Callers take the generation before reading the files, so a change
+ * racing the read leaves the stored value stale rather than the cache.
+ */
+#define CG_COUNT_HASH_SIZE 256
+#define CG_COUNT_MAX 4096
+
+struct cg_count {
+	const char *controller;
+	char *cg;
+	unsigned long gen;
+	int value;
+	struct cg_count *next;
+};
+
+static struct cg_count *cg_count_hash[CG_COUNT_HASH_SIZE];
+static size_t nr_cg_counts;
+static pthread_mutex_t cg_count_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct cg_count **cg_count_slot_locked(const char *controller, const char *cg)
+{
+	struct cg_count **cp;
+
+	cp = &cg_count_hash[(str_hash(controller) ^ str_hash(cg)) % CG_COUNT_HASH_SIZE];
+	for (; *cp; cp = &(*cp)->next) {
+		if (strcmp((*cp)->controller, controller) == 0 && strcmp((*cp)->cg, cg) == 0)
+			break;
+	}
+	return cp;
+}
+
+static bool cg_count_get(const char *controller, const char *cg,
+			 unsigned long gen, int *value)
+{
+	struct cg_count *c;
+	bool found = false;
+
+	if (!cgwatch_watching(controller))
+		return false;
+	pthread_mutex_lock(&cg_count_lock);
+	c = *cg_count_slot_locked(controller, cg);
+	if (c && c->gen == gen) {
+		*value = c->value;
+		found = true;
+	}
+	pthread_mutex_unlock(&cg_count_lock);
+	return found;
+}
+
+/* controller must be a string constant */
+static void cg_count_set(const char *controller, const char *cg,
+			 unsigned long gen, int value)
+{
+	struct cg_count **cp, *c;
+	size_t i;
+
+	if (!cgwatch_watching(controller))
+		return;
+	pthread_mutex_lock(&cg_count_lock);
+	if (!*(cp = cg_count_slot_locked(controller, cg))) {
+		if (nr_cg_counts >= CG_COUNT_MAX) {
+			/* start over rather than keep gone cgroups forever */
+			for (i = 0; i < CG_COUNT_HASH_SIZE; i++) {
+				while ((c = cg_count_hash[i])) {
+					cg_count_hash[i] = c->next;
+					nih_free(c);
+				}
+			}
+			nr_cg_counts = 0;
+			cp = cg_count_slot_locked(controller, cg);
+		}
+		c = NIH_MUST( nih_new(NULL, struct cg_count) );
+		c->controller = controller;
+		c->cg = NIH_MUST( nih_strdup(c, cg) );
+		c->next = NULL;
+		*cp = c;
+		nr_cg_counts++;
+	}
+	(*cp)->gen = gen;
+	(*cp)->value = value;
+	pthread_mutex_unlock(&cg_count_lock);
+}
+
+/*
+ * With -o cpu_quota, the number of cpus the CFS quota of cgroup is
+ * worth, rounded up, or 0 if there is none.  The cpu cgroup is taken
+ * at the same path as the cpuset one, since the files which show cpus
+ * are rendered (and kept as views) per cpuset cgroup.
+ */
+static bool cpu_quota;
+
+static int get_quota_cpus(const char *cg)
+{
+	nih_local struct cgm_batch *b = NULL;
+	char *quota_us, *period_us;
+	long quota, period;
+	unsigned long gen;
+	int n = 0;
+
+	if (!cpu_quota)
+		return 0;
+	gen = cgwatch_generation("cpu", cg);
+	if (cg_count_get("cpu", cg, gen, &n))
+		return n;
+
+	b = cgm_batch_new();
+	/* the cgroup may well not exist in the cpu hierarchy */
+	cgm_batch_quiet(b, true);
+	cgm_batch_get_value(b, "cpu", cg, "cpu.cfs_quota_us", &quota_us);
+	cgm_batch_get_value(b, "cpu", cg, "cpu.cfs_period_us", &period_us);
+	cgm_batch_run(b);
+	if (quota_us && period_us) {
+		quota = strtol(quota_us, NULL, 10);
+		period = strtol(period_us, NULL, 10);
+		if (quota > 0 && period > 0)
+			n = (quota + period - 1) / period;
+	}
+	cg_count_set("cpu", cg, gen, n);
+	return n;
+}
+
 static bool cpuline_in_cpuset(const char *line, const char *cpuset)
 {
 	int cpu;
@@ -1580,27 +2211,20 @@ static bool is_processor_line(const char *line)
 	return false;
 }
 
-static int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
-		struct fuse_file_info *fi)
+static int proc_cpuinfo_read(struct fuse_context *fc, const char *cg,
+		char *buf, size_t size)
 {
-	struct fuse_context *fc = fuse_get_context();
-	nih_local char *cg = get_pid_cgroup(fc->pid, "cpuset");
 	nih_local char *cpuset = NULL;
 	char *line = NULL;
 	size_t linelen = 0, total_len = 0;
 	bool am_printing = false;
-	int curcpu = -1;
+	int curcpu = -1, max_cpus;
 	FILE *f;
 
-	if (offset)
-		return -EINVAL;
-
-	if (!cg)
-		return 0;
-
 	cpuset = get_cpuset(cg);
 	if (!cpuset)
 		return 0;
+	max_cpus = get_quota_cpus(cg);
 
 	f = fopen("/proc/cpuinfo", "r");
 	if (!f)
@@ -1609,7 +2233,8 @@ static int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
 	while (getline(&line, &linelen, f) != -1) {
 		size_t l;
 		if (is_processor_line(line)) {
-			am_printing = cpuline_in_cpuset(line, cpuset);
+			am_printing = cpuline_in_cpuset(line, cpuset) &&
+				(!max_cpus || curcpu + 1 < max_cpus);
 			if (am_printing) {
 				curcpu ++;
 				l = snprintf(buf, size, "processor	: %d\n", curcpu);
@@ -1627,29 +2252,24 @@ static int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
 		}
 	}
 
+	fclose(f);
+	free(line);
 	return total_len;
 }
 
-static int proc_stat_read(char *buf, size_t size, off_t offset,
-		struct fuse_file_info *fi)
+static int proc_stat_read(struct fuse_context *fc, const char *cg,
+		char *buf, size_t size)
 {
-	struct fuse_context *fc = fuse_get_context();
-	nih_local char *cg = get_pid_cgroup(fc->pid, "cpuset");
 	nih_local char *cpuset = NULL;
 	char *line = NULL;
 	size_t linelen = 0, total_len = 0;
-	int curcpu = 0;
+	int curcpu = -1, max_cpus;
 	FILE *f;
 
-	if (offset)
-		return -EINVAL;
-
-	if (!cg)
-		return 0;
-
 	cpuset = get_cpuset(cg);
 	if (!cpuset)
 		return 0;
+	max_cpus = get_quota_cpus(cg);
 
 	f = fopen("/proc/stat", "r");
 	if (!f)
@@ -1660,27 +2280,29 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 		int cpu;
 		char *c;
 
-		if (sscanf(line, "cpu%d", &cpu) != 1) {
-			/* not a ^cpu line, just print it */
+		if (!isdigit(line[3]) || sscanf(line, "cpu%d", &cpu) != 1) {
+			/* not a ^cpuN line, just print it */
 			l = snprintf(buf, size, "%s", line);
 			buf += l;
 			size -= l;
 			total_len += l;
 			continue;
 		}
-		if (!cpu_in_cpuset(cpu, cpuset))
+		if (!cpu_in_cpuset(cpu, cpuset) || (max_cpus && curcpu + 1 >= max_cpus))
 			continue;
 		curcpu ++;
 
 		c = strchr(line, ' ');
 		if (!c)
 			continue;
-		l = snprintf(buf, size, "cpu%d %s", curcpu, c);
+		l = snprintf(buf, size, "cpu%d%s", curcpu, c);
 		buf += l;
 		size -= l;
 		total_len += l;
 	}
 
+	fclose(f);
+	free(line);
 	return total_len;
 }
 
@@ -1760,6 +2382,7 @@ static long int getreaperage(pid_t qpid)
 		return 0;
 	}
 
+	stats_inc(STATS_FORK_UPTIME);
 	pid = fork();
 
 	if (!pid) { // child
@@ -1768,6 +2391,7 @@ static long int getreaperage(pid_t qpid)
 			fprintf(stderr, "Warning: bad write from getreaperage\n");
 		exit(0);
 	}
+	LXCFS_PROBE3(helper__fork, "reaper_age", qpid, pid);
 
 	close(mypipe[1]);
 	FD_ZERO(&s);
@@ -1790,7 +2414,8 @@ static long int getreaperage(pid_t qpid)
 	answer = mtime;
 
 out:
-	wait_for_pid(pid);
+	ret = wait_for_pid(pid);
+	LXCFS_PROBE3(helper__exit, "reaper_age", pid, ret);
 	close(mypipe[0]);
 	return answer;
 }
@@ -1802,7 +2427,8 @@ static long int getprocidle(void)
 	if (!f)
 		return 0;
 	if (fscanf(f, "%ld %ld", &age, &idle) != 2)
-		return 0;
+		idle = 0;
+	fclose(f);
 	return idle;
 }
 
@@ -1811,328 +2437,2978 @@ static long int getprocidle(void)
  * For the first field, we use the mtime for the reaper for
  * the calling pid as returned by getreaperage
  */
-static int proc_uptime_read(char *buf, size_t size, off_t offset,
-		struct fuse_file_info *fi)
+static int proc_uptime_read(struct fuse_context *fc, const char *cg,
+		char *buf, size_t size)
 {
-	struct fuse_context *fc = fuse_get_context();
 	long int reaperage = getreaperage(fc->pid);;
 	long int idletime = getprocidle();
 
-	if (offset)
-		return -EINVAL;
 	return snprintf(buf, size, "%ld %ld\n", reaperage, idletime);
 }
 
-static off_t get_procfile_size(const char *which)
-{
-	FILE *f = fopen(which, "r");
-	char *line = NULL;
-	size_t len = 0;
-	ssize_t sz, answer = 0;
-	if (!f)
-		return 0;
-
-	while ((sz = getline(&line, &len, f)) != -1)
-		answer += sz;
-	fclose (f);
+/*
+ * Names of the host's block devices, from /proc/partitions.  The list is
+ * read again when asked about a device it does not know, at most once a
+ * second, to pick up devices which were added since.
+ */
+struct devname {
+	unsigned int major, minor;
+	char *name;
+	struct devname *next;
+};
 
-	return answer;
-}
+static struct devname *devnames;
+static time_t devnames_read;
+static pthread_mutex_t devname_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static int proc_getattr(const char *path, struct stat *sb)
+static void devnames_load_locked(void)
 {
-	struct timespec now;
+	struct devname *d;
+	char *line = NULL, name[100];
+	size_t len = 0;
+	unsigned int major, minor;
+	FILE *f;
 
-	memset(sb, 0, sizeof(struct stat));
-	if (clock_gettime(CLOCK_REALTIME, &now) < 0)
-		return -EINVAL;
-	sb->st_uid = sb->st_gid = 0;
-	sb->st_atim = sb->st_mtim = sb->st_ctim = now;
-	if (strcmp(path, "/proc") == 0) {
-		sb->st_mode = S_IFDIR | 00555;
-		sb->st_nlink = 2;
-		return 0;
+	devnames_read = time(NULL);
+	if (!(f = fopen("/proc/partitions", "r")))
+		return;
+	while ((d = devnames)) {
+		devnames = d->next;
+		nih_free(d);
 	}
-	if (strcmp(path, "/proc/meminfo") == 0 ||
-			strcmp(path, "/proc/cpuinfo") == 0 ||
-			strcmp(path, "/proc/uptime") == 0 ||
-			strcmp(path, "/proc/stat") == 0) {
-
-		sb->st_size = get_procfile_size(path);
-		sb->st_mode = S_IFREG | 00444;
-		sb->st_nlink = 1;
-		return 0;
+	while (getline(&line, &len, f) != -1) {
+		if (sscanf(line, "%u %u %*u %99s", &major, &minor, name) != 3)
+			continue;
+		d = NIH_MUST( nih_new(NULL, struct devname) );
+		d->major = major;
+		d->minor = minor;
+		d->name = NIH_MUST( nih_strdup(d, name) );
+		d->next = devnames;
+		devnames = d;
 	}
-
-	return -ENOENT;
+	fclose(f);
+	free(line);
 }
 
-static int proc_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
-		struct fuse_file_info *fi)
+/* the name of device major:minor, nih_alloc'd, or NULL if it has none */
+static char *devname_get(unsigned int major, unsigned int minor)
 {
-	if (filler(buf, "cpuinfo", NULL, 0) != 0 ||
-				filler(buf, "meminfo", NULL, 0) != 0 ||
-				filler(buf, "stat", NULL, 0) != 0 ||
-				filler(buf, "uptime", NULL, 0) != 0)
-		return -EINVAL;
-	return 0;
+	struct devname *d;
+	char *name = NULL;
+	bool reread = false;
+
+	pthread_mutex_lock(&devname_lock);
+	for (;;) {
+		for (d = devnames; d; d = d->next) {
+			if (d->major == major && d->minor == minor)
+				break;
+		}
+		if (d || reread || time(NULL) == devnames_read)
+			break;
+		devnames_load_locked();
+		reread = true;
+	}
+	if (d)
+		name = NIH_MUST( nih_strdup(NULL, d->name) );
+	pthread_mutex_unlock(&devname_lock);
+	return name;
 }
 
-static int proc_open(const char *path, struct fuse_file_info *fi)
-{
-	if (strcmp(path, "/proc/meminfo") == 0 ||
-			strcmp(path, "/proc/cpuinfo") == 0 ||
-			strcmp(path, "/proc/uptime") == 0 ||
-			strcmp(path, "/proc/stat") == 0)
-		return 0;
-	return -ENOENT;
-}
+/* what blkio tells us about a device, as stat[BLKIO_xxx][BLKIO_READ or BLKIO_WRITE] */
+enum blkio_stat {
+	BLKIO_IOS,
+	BLKIO_BYTES,
+	BLKIO_WAIT_NS,
+	BLKIO_NR_STATS,
+};
+#define BLKIO_READ 0
+#define BLKIO_WRITE 1
 
-static int proc_read(const char *path, char *buf, size_t size, off_t offset,
-		struct fuse_file_info *fi)
+struct blkio_dev {
+	unsigned int major, minor;
+	uint64_t stat[BLKIO_NR_STATS][2];
+};
+
+/*
+ * Add the "major:minor Read|Write value" lines of a blkio file to stat
+ * of each device in *devs, adding devices as they come up.
+ */
+static void blkio_parse(const char *data, enum blkio_stat stat,
+		struct blkio_dev **devs, size_t *n)
 {
-	if (strcmp(path, "/proc/meminfo") == 0)
-		return proc_meminfo_read(buf, size, offset, fi);
-	if (strcmp(path, "/proc/cpuinfo") == 0)
-		return proc_cpuinfo_read(buf, size, offset, fi);
-	if (strcmp(path, "/proc/uptime") == 0)
-		return proc_uptime_read(buf, size, offset, fi);
-	if (strcmp(path, "/proc/stat") == 0)
-		return proc_stat_read(buf, size, offset, fi);
-	return -EINVAL;
+	unsigned int major, minor;
+	unsigned long long v;
+	char op[10];
+	size_t i;
+	int rw;
+
+	while (*data) {
+		if (sscanf(data, "%u:%u %9s %llu", &major, &minor, op, &v) == 4 &&
+				(strcmp(op, "Read") == 0 || strcmp(op, "Write") == 0)) {
+			rw = strcmp(op, "Read") == 0 ? BLKIO_READ : BLKIO_WRITE;
+			for (i = 0; i < *n; i++) {
+				if ((*devs)[i].major == major && (*devs)[i].minor == minor)
+					break;
+			}
+			if (i == *n) {
+				*devs = NIH_MUST( nih_realloc(*devs, NULL, (*n + 1) * sizeof(**devs)) );
+				memset(&(*devs)[i], 0, sizeof(**devs));
+				(*devs)[i].major = major;
+				(*devs)[i].minor = minor;
+				(*n)++;
+			}
+			(*devs)[i].stat[stat][rw] += v;
+		}
+		data = strchr(data, '\n');
+		if (!data)
+			return;
+		data++;
+	}
 }
 
 /*
- * FUSE ops for /
- * these just delegate to the /proc and /cgroup ops as
- * needed
+ * /proc/diskstats as seen by the blkio cgroup: reads and writes
+ * completed, sectors and time spent waiting, per device.  Merges, I/Os
+ * in flight and the time the device was busy are not accounted per
+ * cgroup, and show as 0.
+ */
+static int proc_diskstats_read(struct fuse_context *fc, const char *cg,
+		char *buf, size_t size)
+{
+	nih_local struct cgm_batch *b = NULL;
+	nih_local struct blkio_dev *devs = NULL;
+	nih_local char *out = NULL;
+	char *serviced, *bytes, *wait;
+	size_t n = 0, i, len;
+
+	b = cgm_batch_new();
+	cgm_batch_get_value(b, "blkio", cg, "blkio.io_serviced_recursive", &serviced);
+	cgm_batch_get_value(b, "blkio", cg, "blkio.io_service_bytes_recursive", &bytes);
+	/* only there with cfq */
+	cgm_batch_quiet(b, true);
+	cgm_batch_get_value(b, "blkio", cg, "blkio.io_wait_time_recursive", &wait);
+	if (!cgm_batch_run(b))
+		return 0;
+
+	blkio_parse(serviced, BLKIO_IOS, &devs, &n);
+	blkio_parse(bytes, BLKIO_BYTES, &devs, &n);
+	if (wait)
+		blkio_parse(wait, BLKIO_WAIT_NS, &devs, &n);
+
+	out = NIH_MUST( nih_strdup(NULL, "") );
+	for (i = 0; i < n; i++) {
+		struct blkio_dev *d = &devs[i];
+		nih_local char *name = devname_get(d->major, d->minor);
+		unsigned long rd_ms = d->stat[BLKIO_WAIT_NS][BLKIO_READ] / 1000000;
+		unsigned long wr_ms = d->stat[BLKIO_WAIT_NS][BLKIO_WRITE] / 1000000;
+
+		if (!name)
+			continue;
+		NIH_MUST( nih_strcat_sprintf(&out, NULL,
+			"%4u %7u %s %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu\n",
+			d->major, d->minor, name,
+			(unsigned long) d->stat[BLKIO_IOS][BLKIO_READ], 0UL,
+			(unsigned long) (d->stat[BLKIO_BYTES][BLKIO_READ] / 512), rd_ms,
+			(unsigned long) d->stat[BLKIO_IOS][BLKIO_WRITE], 0UL,
+			(unsigned long) (d->stat[BLKIO_BYTES][BLKIO_WRITE] / 512), wr_ms,
+			0UL, 0UL, rd_ms + wr_ms) );
+	}
+	len = MIN(strlen(out), size);
+	memcpy(buf, out, len);
+	return len;
+}
+
+/*
+ * /proc/loadavg per cpu cgroup.  The first read from a cgroup starts
+ * tracking it, and the sampler thread then counts its runnable tasks
+ * every LOAD_FREQ seconds and folds the count into the averages the way
+ * the kernel does.  Reads only format what the sampler last computed.
+ * A cgroup which is gone, or which nobody has read for LOADAVG_IDLE
+ * seconds, is no longer tracked.
  */
+#define LOADAVG_HASH_SIZE 256
+#define LOADAVG_IDLE 3600
+#define LOAD_FREQ 5
+
+/* the kernel's fixed point, see include/linux/sched/loadavg.h */
+#define FSHIFT 11
+#define FIXED_1 (1UL << FSHIFT)
+#define EXP_1 1884
+#define EXP_5 2014
+#define EXP_15 2037
+#define LOAD_INT(x) ((x) >> FSHIFT)
+#define LOAD_FRAC(x) LOAD_INT(((x) & (FIXED_1 - 1)) * 100)
+
+struct loadavg {
+	char *cg;
+	unsigned long avg[3];
+	unsigned int running, threads;
+	uint64_t last_read;
+	struct loadavg *next;
+};
 
-static int lxcfs_getattr(const char *path, struct stat *sb)
+static struct loadavg *loadavg_hash[LOADAVG_HASH_SIZE];
+/* only the sampler frees hashed entries */
+static pthread_mutex_t loadavg_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool loadavg_sampling;
+
+static struct loadavg **loadavg_slot_locked(const char *cg)
 {
-	if (strcmp(path, "/") == 0) {
-		sb->st_mode = S_IFDIR | 00755;
+	struct loadavg **lp;
+
+	for (lp = &loadavg_hash[str_hash(cg) % LOADAVG_HASH_SIZE]; *lp; lp = &(*lp)->next) {
+		if (strcmp((*lp)->cg, cg) == 0)
+			break;
+	}
+	return lp;
+}
+
+static unsigned long calc_load(unsigned long load, unsigned long exp,
+		unsigned long active)
+{
+	unsigned long newload = load * exp + active * (FIXED_1 - exp);
+
+	if (active >= load)
+		newload += FIXED_1 - 1;
+	return newload / FIXED_1;
+}
+
+/* whether task tid is running or waiting to, or in uninterruptible sleep */
+static bool task_runnable(const char *tid)
+{
+	char path[100], stat[512], *p;
+	ssize_t len;
+	int fd;
+
+	snprintf(path, 100, "/proc/%s/stat", tid);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return false;
+	len = read(fd, stat, sizeof(stat) - 1);
+	close(fd);
+	if (len <= 0)
+		return false;
+	stat[len] = '\0';
+	/* the state follows the command, which may hold anything */
+	if (!(p = strrchr(stat, ')')))
+		return false;
+	return p[1] == ' ' && (p[2] == 'R' || p[2] == 'D');
+}
+
+static void loadavg_sample(void)
+{
+	uint64_t now = stats_now(), idle = LOADAVG_IDLE * 1000000000ULL;
+	nih_local struct loadavg **todo = NULL;
+	nih_local unsigned int *running = NULL, *threads = NULL;
+	nih_local bool *gone = NULL;
+	char **level, **next;
+	size_t *owner, *nextowner;
+	struct loadavg **lp, *l;
+	size_t n = 0, nlevel, nnext, depth, i;
+	char *tid, *saveptr;
+
+	pthread_mutex_lock(&loadavg_lock);
+	for (i = 0; i < LOADAVG_HASH_SIZE; i++) {
+		for (lp = &loadavg_hash[i]; (l = *lp); ) {
+			if (l->last_read + idle < now) {
+				*lp = l->next;
+				nih_free(l);
+			} else {
+				n++;
+				lp = &l->next;
+			}
+		}
+	}
+	todo = NIH_MUST( nih_alloc(NULL, (n + 1) * sizeof(*todo)) );
+	n = 0;
+	for (i = 0; i < LOADAVG_HASH_SIZE; i++) {
+		for (l = loadavg_hash[i]; l; l = l->next)
+			todo[n++] = l;
+	}
+	pthread_mutex_unlock(&loadavg_lock);
+	if (!n)
+		return;
+
+	running = NIH_MUST( nih_alloc(NULL, n * sizeof(*running)) );
+	threads = NIH_MUST( nih_alloc(NULL, n * sizeof(*threads)) );
+	gone = NIH_MUST( nih_alloc(NULL, n * sizeof(*gone)) );
+	memset(running, 0, n * sizeof(*running));
+	memset(threads, 0, n * sizeof(*threads));
+
+	/*
+	 * A container's load counts the tasks of all the cgroups under its
+	 * own, so walk down from every tracked cgroup at once, one round
+	 * trip per level as dump_render does.  owner[i] is the entry in
+	 * todo which level[i] counts towards.
+	 */
+	level = NIH_MUST( nih_str_array_new(NULL) );
+	owner = NIH_MUST( nih_alloc(level, n * sizeof(*owner)) );
+	nlevel = 0;
+	for (i = 0; i < n; i++) {
+		NIH_MUST( nih_str_array_add(&level, NULL, &nlevel, todo[i]->cg) );
+		owner[i] = i;
+	}
+	for (depth = 0; nlevel; depth++) {
+		nih_local struct cgm_batch *b = NULL;
+		nih_local char ***children = NULL;
+		nih_local char **tasks = NULL;
+
+		children = NIH_MUST( nih_alloc(NULL, nlevel * sizeof(*children)) );
+		tasks = NIH_MUST( nih_alloc(NULL, nlevel * sizeof(*tasks)) );
+		b = cgm_batch_new();
+		/* cgroups may go away while we walk */
+		cgm_batch_quiet(b, true);
+		for (i = 0; i < nlevel; i++) {
+			cgm_batch_list_children(b, "cpu", level[i], &children[i]);
+			cgm_batch_get_value(b, "cpu", level[i], "tasks", &tasks[i]);
+		}
+		cgm_batch_run(b);
+
+		next = NIH_MUST( nih_str_array_new(NULL) );
+		nextowner = NULL;
+		nnext = 0;
+		for (i = 0; i < nlevel; i++) {
+			size_t k;
+
+			/* a tracked cgroup without tasks is most likely gone */
+			if (depth == 0)
+				gone[i] = !tasks[i];
+			if (!tasks[i])
+				continue;
+			for (tid = strtok_r(tasks[i], "\n", &saveptr); tid;
+					tid = strtok_r(NULL, "\n", &saveptr)) {
+				threads[owner[i]]++;
+				if (task_runnable(tid))
+					running[owner[i]]++;
+			}
+			for (k = 0; children[i] && children[i][k]; k++) {
+				nih_local char *cg = NULL;
+
+				if (strcmp(level[i], "/") == 0)
+					cg = NIH_MUST( nih_strdup(NULL, children[i][k]) );
+				else
+					cg = NIH_MUST( nih_sprintf(NULL, "%s/%s", level[i], children[i][k]) );
+				NIH_MUST( nih_str_array_add(&next, NULL, &nnext, cg) );
+				nextowner = NIH_MUST( nih_realloc(nextowner, next,
+						nnext * sizeof(*nextowner)) );
+				nextowner[nnext - 1] = owner[i];
+			}
+		}
+		nih_free(level);
+		level = next;
+		owner = nextowner;
+		nlevel = nnext;
+	}
+	nih_free(level);
+
+	for (i = 0; i < n; i++) {
+		l = todo[i];
+		if (gone[i]) {
+			pthread_mutex_lock(&loadavg_lock);
+			lp = loadavg_slot_locked(l->cg);
+			*lp = l->next;
+			pthread_mutex_unlock(&loadavg_lock);
+			nih_free(l);
+			continue;
+		}
+		pthread_mutex_lock(&loadavg_lock);
+		l->avg[0] = calc_load(l->avg[0], EXP_1, running[i] * FIXED_1);
+		l->avg[1] = calc_load(l->avg[1], EXP_5, running[i] * FIXED_1);
+		l->avg[2] = calc_load(l->avg[2], EXP_15, running[i] * FIXED_1);
+		l->running = running[i];
+		l->threads = threads[i];
+		pthread_mutex_unlock(&loadavg_lock);
+	}
+}
+
+static void *loadavg_sampler(void *arg)
+{
+	struct timespec ts = { LOAD_FREQ, 0 };
+	sigset_t sigs;
+
+	/* leave signals to the fuse loop */
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	for (;;) {
+		nanosleep(&ts, NULL);
+		loadavg_sample();
+	}
+	return NULL;
+}
+
+static bool loadavg_start(void)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	int ret;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, loadavg_sampler, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret != 0)
+		return false;
+	loadavg_sampling = true;
+	return true;
+}
+
+/* the last field of the host's /proc/loadavg, the last pid handed out */
+static long get_last_pid(void)
+{
+	char line[200];
+	long last_pid = 0;
+	FILE *f;
+
+	if (!(f = fopen("/proc/loadavg", "r")))
+		return 0;
+	if (fgets(line, sizeof(line), f))
+		sscanf(line, "%*s %*s %*s %*s %ld", &last_pid);
+	fclose(f);
+	return last_pid;
+}
+
+static int proc_loadavg_read(struct fuse_context *fc, const char *cg,
+		char *buf, size_t size)
+{
+	unsigned long avg[3] = { 0, 0, 0 };
+	unsigned int running = 0, threads = 0;
+	struct loadavg **lp, *l;
+	FILE *f;
+
+	if (!loadavg_sampling) {
+		/* without the sampler there is nothing to show but the host's */
+		if (!(f = fopen("/proc/loadavg", "r")))
+			return 0;
+		size = fread(buf, 1, size, f);
+		fclose(f);
+		return size;
+	}
+
+	pthread_mutex_lock(&loadavg_lock);
+	lp = loadavg_slot_locked(cg);
+	if ((l = *lp)) {
+		memcpy(avg, l->avg, sizeof(avg));
+		running = l->running;
+		threads = l->threads;
+	} else {
+		l = NIH_MUST( nih_new(NULL, struct loadavg) );
+		memset(l, 0, sizeof(*l));
+		l->cg = NIH_MUST( nih_strdup(l, cg) );
+		*lp = l;
+	}
+	l->last_read = stats_now();
+	pthread_mutex_unlock(&loadavg_lock);
+
+	return snprintf(buf, size, "%lu.%02lu %lu.%02lu %lu.%02lu %u/%u %ld\n",
+			LOAD_INT(avg[0]), LOAD_FRAC(avg[0]),
+			LOAD_INT(avg[1]), LOAD_FRAC(avg[1]),
+			LOAD_INT(avg[2]), LOAD_FRAC(avg[2]),
+			running, threads, get_last_pid());
+}
+
+static off_t get_procfile_size(const char *which)
+{
+	FILE *f = fopen(which, "r");
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t sz, answer = 0;
+	if (!f)
+		return 0;
+
+	while ((sz = getline(&line, &len, f)) != -1)
+		answer += sz;
+	fclose (f);
+	free(line);
+
+	return answer;
+}
+
+/*
+ * Registry of the virtualized /proc files.
+ *
+ * Each file names the function which renders it, the controller whose
+ * cgroup (for the calling task) the renderer needs, how its contents
+ * may be cached, and the size to report in getattr.  The renderer is
+ * passed the caller's cgroup for that controller, or NULL if the file
+ * does not declare one.  Adding a file only means adding it here.
+ */
+enum proc_cache_policy {
+	PROC_CACHE_NONE,	/* render afresh on every read */
+	PROC_CACHE_REFRESH,	/* with -o refresh, serve a view kept fresh in the background */
+};
+
+struct proc_file {
+	const char *name;
+	const char *controller;
+	int (*render)(struct fuse_context *fc, const char *cg, char *buf, size_t size);
+	enum proc_cache_policy cache;
+	off_t size;		/* 0: use the size of the host's file */
+	struct proc_file *next;	/* hash chain */
+};
+
+static struct proc_file proc_files[] = {
+	{ "cpuinfo",   "cpuset", proc_cpuinfo_read,   PROC_CACHE_REFRESH, 0 },
+	{ "diskstats", "blkio",  proc_diskstats_read, PROC_CACHE_REFRESH, 0 },
+	{ "loadavg",   "cpu",    proc_loadavg_read,   PROC_CACHE_NONE, 0 },
+	{ "meminfo",   "memory", proc_meminfo_read,   PROC_CACHE_REFRESH, 0 },
+	{ "stat",      "cpuset", proc_stat_read,      PROC_CACHE_REFRESH, 0 },
+	{ "swaps",     "memory", proc_swaps_read,     PROC_CACHE_REFRESH, 0 },
+	{ "uptime",    NULL,     proc_uptime_read,    PROC_CACHE_NONE, 0 },
+	{ NULL }
+};
+
+#define PROC_HASH_SIZE 32
+static struct proc_file *proc_hash[PROC_HASH_SIZE];
+
+static void proc_files_init(void)
+{
+	struct proc_file *p;
+
+	for (p = proc_files; p->name; p++) {
+		unsigned int h = str_hash(p->name) % PROC_HASH_SIZE;
+		p->next = proc_hash[h];
+		proc_hash[h] = p;
+	}
+}
+
+/*
+ * given /proc/meminfo, return the registry entry for meminfo, or
+ * NULL if we do not serve that file.
+ */
+static struct proc_file *find_proc_file(const char *path)
+{
+	struct proc_file *p;
+
+	if (strncmp(path, "/proc/", 6) != 0)
+		return NULL;
+	path += 6;
+	for (p = proc_hash[str_hash(path) % PROC_HASH_SIZE]; p; p = p->next) {
+		if (strcmp(p->name, path) == 0)
+			return p;
+	}
+	return NULL;
+}
+
+/*
+ * Views kept fresh in the background, for -o refresh=SECS.
+ *
+ * A view is a PROC_CACHE_REFRESH file as rendered for one cgroup.  The
+ * first read of a file from a cgroup renders it as usual and keeps the
+ * result as a view, which the refresher thread then renders again every
+ * SECS seconds.  Later reads just copy the view, so they see data up to
+ * SECS old but never wait on cgmanager.  Views nobody has read for
+ * VIEW_IDLE_ROUNDS refreshes are dropped.
+ */
+#define VIEW_HASH_SIZE 256
+#define VIEW_IDLE_ROUNDS 10
+
+struct proc_view {
+	struct proc_file *file;
+	char *cg;
+	char *buf;		/* both nih_alloc'd children of the view */
+	size_t len;
+	size_t bufsize;		/* the largest read seen, to render into */
+	uint64_t last_read;
+	struct proc_view *next;
+};
+
+static struct proc_view *view_hash[VIEW_HASH_SIZE];
+/* only the refresher frees hashed views, or replaces their buf */
+static pthread_mutex_t view_lock = PTHREAD_MUTEX_INITIALIZER;
+static double proc_refresh;	/* seconds between refreshes, 0 for none */
+
+static struct proc_view **view_slot_locked(struct proc_file *p, const char *cg)
+{
+	struct proc_view **vp;
+
+	vp = &view_hash[(str_hash(p->name) ^ str_hash(cg)) % VIEW_HASH_SIZE];
+	for (; *vp; vp = &(*vp)->next) {
+		if ((*vp)->file == p && strcmp((*vp)->cg, cg) == 0)
+			break;
+	}
+	return vp;
+}
+
+/*
+ * Copy the view of p for cg into buf.  Return its length, or -1 if
+ * there is none yet.
+ */
+static int view_read(struct proc_file *p, const char *cg, char *buf, size_t size)
+{
+	struct proc_view *v;
+	size_t len;
+
+	pthread_mutex_lock(&view_lock);
+	v = *view_slot_locked(p, cg);
+	if (!v) {
+		pthread_mutex_unlock(&view_lock);
+		stats_inc(STATS_VIEW_MISS);
+		return -1;
+	}
+	len = MIN(v->len, size);
+	memcpy(buf, v->buf, len);
+	v->last_read = stats_now();
+	if (size > v->bufsize)
+		v->bufsize = size;
+	pthread_mutex_unlock(&view_lock);
+	stats_inc(STATS_VIEW_HIT);
+	return len;
+}
+
+/* keep what a reader just rendered as the view of p for cg */
+static void view_add(struct proc_file *p, const char *cg, const char *buf,
+		size_t len, size_t size)
+{
+	struct proc_view **vp, *v;
+
+	v = NIH_MUST( nih_new(NULL, struct proc_view) );
+	v->file = p;
+	v->cg = NIH_MUST( nih_strdup(v, cg) );
+	v->buf = NIH_MUST( nih_alloc(v, len) );
+	memcpy(v->buf, buf, len);
+	v->len = len;
+	v->bufsize = size;
+	v->last_read = stats_now();
+	v->next = NULL;
+
+	pthread_mutex_lock(&view_lock);
+	vp = view_slot_locked(p, cg);
+	if (*vp) {
+		/* another reader got there first */
+		pthread_mutex_unlock(&view_lock);
+		nih_free(v);
+		return;
+	}
+	*vp = v;
+	pthread_mutex_unlock(&view_lock);
+}
+
+static void view_drop(struct proc_view *v)
+{
+	struct proc_view **vp;
+
+	pthread_mutex_lock(&view_lock);
+	vp = view_slot_locked(v->file, v->cg);
+	*vp = v->next;
+	pthread_mutex_unlock(&view_lock);
+	nih_free(v);
+}
+
+/*
+ * Publish the numbers behind a view we just refreshed, as its renderer
+ * fetched them, see export.h.  Several views of a cgroup (meminfo and
+ * swaps, stat and cpuinfo) fetch the same numbers, which are only
+ * written once a round.
+ */
+static void view_export(struct proc_view *v, const struct view_numbers *nums)
+{
+	const struct mem_values *m = &nums->mem;
+	struct export_record *r;
+
+	if ((nums->flags & EXPORT_MEMORY) && !export_written(v->cg, EXPORT_MEMORY) &&
+			(r = export_begin(v->cg, EXPORT_MEMORY))) {
+		r->mem_limit = m->limit;
+		r->mem_usage = m->usage;
+		r->mem_cached = m->cached;
+		export_end(r, EXPORT_MEMORY);
+	}
+	if ((nums->flags & EXPORT_CPUSET) && !export_written(v->cg, EXPORT_CPUSET) &&
+			(r = export_begin(v->cg, EXPORT_CPUSET))) {
+		r->nr_cpus = cpuset_nr_cpus(nums->cpuset);
+		strcpy(r->cpuset, nums->cpuset);
+		export_end(r, EXPORT_CPUSET);
+	}
+}
+
+static void views_refresh(void)
+{
+	struct fuse_context *fc = lxcfs_get_context();
+	uint64_t now = stats_now(), idle = VIEW_IDLE_ROUNDS * proc_refresh * 1000000000;
+	nih_local struct proc_view **todo = NULL;
+	struct proc_view *v;
+	struct view_numbers nums;
+	size_t n = 0, i, bufsize;
+	char *buf, *old;
+	bool unread;
+	int len;
+
+	/* hashed views are only freed here, so these stay valid */
+	pthread_mutex_lock(&view_lock);
+	for (i = 0; i < VIEW_HASH_SIZE; i++) {
+		for (v = view_hash[i]; v; v = v->next)
+			n++;
+	}
+	todo = NIH_MUST( nih_alloc(NULL, (n + 1) * sizeof(*todo)) );
+	n = 0;
+	for (i = 0; i < VIEW_HASH_SIZE; i++) {
+		for (v = view_hash[i]; v; v = v->next)
+			todo[n++] = v;
+	}
+	pthread_mutex_unlock(&view_lock);
+
+	if (export_enabled())
+		export_round();
+	for (i = 0; i < n; i++) {
+		v = todo[i];
+		pthread_mutex_lock(&view_lock);
+		unread = v->last_read + idle < now;
+		bufsize = v->bufsize;
+		pthread_mutex_unlock(&view_lock);
+		if (unread) {
+			view_drop(v);
+			continue;
+		}
+
+		buf = NIH_MUST( nih_alloc(v, bufsize) );
+		nums.flags = 0;
+		if (export_enabled())
+			view_numbers = &nums;
+		len = v->file->render(fc, v->cg, buf, bufsize);
+		view_numbers = NULL;
+		if (len <= 0) {
+			/* most likely the cgroup is gone */
+			view_drop(v);
+			continue;
+		}
+		pthread_mutex_lock(&view_lock);
+		old = v->buf;
+		v->buf = buf;
+		v->len = MIN((size_t) len, bufsize);
+		pthread_mutex_unlock(&view_lock);
+		nih_free(old);
+		if (export_enabled())
+			view_export(v, &nums);
+	}
+	if (export_enabled())
+		export_sweep();
+}
+
+static void *view_refresher(void *arg)
+{
+	struct timespec ts;
+	sigset_t sigs;
+
+	/* leave signals to the fuse loop */
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	ts.tv_sec = proc_refresh;
+	ts.tv_nsec = (proc_refresh - ts.tv_sec) * 1000000000;
+	for (;;) {
+		nanosleep(&ts, NULL);
+		views_refresh();
+	}
+	return NULL;
+}
+
+/* start refreshing the views every secs seconds */
+static bool views_start(double secs)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	int ret;
+
+	proc_refresh = secs;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, view_refresher, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret != 0) {
+		proc_refresh = 0;
+		return false;
+	}
+	return true;
+}
+
+static int proc_getattr(const char *path, struct stat *sb)
+{
+	struct timespec now;
+	struct proc_file *p;
+
+	memset(sb, 0, sizeof(struct stat));
+	if (clock_gettime(CLOCK_REALTIME, &now) < 0)
+		return -EINVAL;
+	sb->st_uid = sb->st_gid = 0;
+	sb->st_atim = sb->st_mtim = sb->st_ctim = now;
+	if (strcmp(path, "/proc") == 0) {
+		sb->st_mode = S_IFDIR | 00555;
 		sb->st_nlink = 2;
 		return 0;
 	}
-	if (strncmp(path, "/cgroup", 7) == 0) {
-		return cg_getattr(path, sb);
+	if ((p = find_proc_file(path)) != NULL) {
+		if (p->size)
+			sb->st_size = p->size;
+		else
+			sb->st_size = get_procfile_size(path);
+		sb->st_mode = S_IFREG | 00444;
+		sb->st_nlink = 1;
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+static int proc_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+		struct fuse_file_info *fi)
+{
+	struct proc_file *p;
+
+	for (p = proc_files; p->name; p++) {
+		if (filler(buf, p->name, NULL, 0) != 0)
+			return -EINVAL;
+	}
+	return 0;
+}
+
+static int proc_open(const char *path, struct fuse_file_info *fi)
+{
+	if (find_proc_file(path))
+		return 0;
+	return -ENOENT;
+}
+
+static int proc_read(const char *path, char *buf, size_t size, off_t offset,
+		struct fuse_file_info *fi)
+{
+	struct fuse_context *fc = lxcfs_get_context();
+	struct proc_file *p;
+	nih_local char *cg = NULL;
+	int ret;
+
+	if (!(p = find_proc_file(path)))
+		return -EINVAL;
+	if (offset)
+		return -EINVAL;
+
+	if (p->controller) {
+		cg = get_pid_cgroup(fc->pid, p->controller);
+		if (!cg)
+			return 0;
+	}
+	if (p->cache != PROC_CACHE_REFRESH || !proc_refresh || !cg)
+		return p->render(fc, cg, buf, size);
+
+	ret = view_read(p, cg, buf, size);
+	if (ret >= 0)
+		return ret;
+	ret = p->render(fc, cg, buf, size);
+	if (ret > 0)
+		view_add(p, cg, buf, MIN((size_t) ret, size), size);
+	return ret;
+}
+
+/*
+ * FUSE ops for /sys
+ *
+ * /sys/devices/system/cpu/online and possible, which runtimes read to
+ * size their thread pools, list as many cpus as the caller's cpuset has.
+ * Like /proc/cpuinfo and /proc/stat, they number those cpus from 0.
+ */
+#define SYS_CPU_DIR "/sys/devices/system/cpu"
+
+static int get_nr_cpus(const char *cg)
+{
+	nih_local char *cpuset = NULL;
+	unsigned long gen;
+	int n, quota;
+
+	gen = cgwatch_generation("cpuset", cg);
+	if (!cg_count_get("cpuset", cg, gen, &n)) {
+		if (!(cpuset = get_cpuset(cg)))
+			return 0;
+		stripnewline(cpuset);
+		n = cpuset_nr_cpus(cpuset);
+		cg_count_set("cpuset", cg, gen, n);
+	}
+	quota = get_quota_cpus(cg);
+	if (quota && quota < n)
+		n = quota;
+	return n;
+}
+
+static bool is_sys_cpu_file(const char *path)
+{
+	return strcmp(path, SYS_CPU_DIR "/online") == 0 ||
+		strcmp(path, SYS_CPU_DIR "/possible") == 0;
+}
+
+static bool is_sys_dir(const char *path)
+{
+	return strcmp(path, "/sys") == 0 || strcmp(path, "/sys/devices") == 0 ||
+		strcmp(path, "/sys/devices/system") == 0 ||
+		strcmp(path, SYS_CPU_DIR) == 0;
+}
+
+static int sys_getattr(const char *path, struct stat *sb)
+{
+	struct timespec now;
+
+	memset(sb, 0, sizeof(struct stat));
+	if (clock_gettime(CLOCK_REALTIME, &now) < 0)
+		return -EINVAL;
+	sb->st_atim = sb->st_mtim = sb->st_ctim = now;
+
+	if (is_sys_dir(path)) {
+		sb->st_mode = S_IFDIR | 00555;
+		sb->st_nlink = 2;
+		return 0;
+	}
+	if (is_sys_cpu_file(path)) {
+		/* what sysfs says about its own files */
+		sb->st_size = 4096;
+		sb->st_mode = S_IFREG | 00444;
+		sb->st_nlink = 1;
+		return 0;
+	}
+	return -ENOENT;
+}
+
+static int sys_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+		struct fuse_file_info *fi)
+{
+	const char *names[2] = { NULL, NULL };
+	int i;
+
+	if (strcmp(path, "/sys") == 0)
+		names[0] = "devices";
+	else if (strcmp(path, "/sys/devices") == 0)
+		names[0] = "system";
+	else if (strcmp(path, "/sys/devices/system") == 0)
+		names[0] = "cpu";
+	else {
+		names[0] = "online";
+		names[1] = "possible";
+	}
+	for (i = 0; i < 2 && names[i]; i++) {
+		if (filler(buf, names[i], NULL, 0) != 0)
+			return -EINVAL;
+	}
+	return 0;
+}
+
+static int sys_open(const char *path, struct fuse_file_info *fi)
+{
+	if (!is_sys_cpu_file(path))
+		return -ENOENT;
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+	return 0;
+}
+
+static int sys_read(const char *path, char *buf, size_t size, off_t offset,
+		struct fuse_file_info *fi)
+{
+	struct fuse_context *fc = lxcfs_get_context();
+	nih_local char *cg = NULL;
+	int n;
+
+	if (!is_sys_cpu_file(path))
+		return -EINVAL;
+	if (offset)
+		return 0;
+
+	if (!(cg = get_pid_cgroup(fc->pid, "cpuset")))
+		return 0;
+	if ((n = get_nr_cpus(cg)) <= 0)
+		return 0;
+	if (n == 1)
+		return snprintf(buf, size, "0\n");
+	return snprintf(buf, size, "0-%d\n", n - 1);
+}
+
+/*
+ * FUSE ops for /lxcfs, which is about lxcfs itself and only for root
+ */
+
+/*
+ * /lxcfs/dump/<controller> holds the whole hierarchy of a controller:
+ * each cgroup's path on a line of its own, parents before children,
+ * followed by a "key value" line for each of the DUMP_KEYS which belong
+ * to that controller.  Host monitoring can then scrape every container
+ * with one open.  The hierarchy is walked a level at a time, asking
+ * cgmanager about the whole level in one round trip.
+ */
+static const char *dump_keys[] = {
+	"memory.usage_in_bytes",
+	"memory.limit_in_bytes",
+	"memory.memsw.usage_in_bytes",
+	"cpuacct.usage",
+	"cpu.shares",
+	"cpuset.cpus",
+	"blkio.weight",
+	NULL
+};
+
+/* the controller of a /lxcfs/dump file, or NULL if there is none such */
+static const char *dump_controller(const char *path)
+{
+	char **list = LXCFS_DATA ? LXCFS_DATA->subsystems : NULL;
+	int i;
+
+	if (strncmp(path, "/lxcfs/dump/", 12) != 0 || !list)
+		return NULL;
+	path += 12;
+	for (i = 0; list[i]; i++) {
+		if (strcmp(list[i], path) == 0)
+			return list[i];
+	}
+	return NULL;
+}
+
+static char *dump_render(const void *parent, const char *controller)
+{
+	nih_local const char **keys = NULL;
+	char **level, **next;
+	size_t nkeys = 0, n, nnext, i, j, k;
+	char *out;
+
+	keys = NIH_MUST( nih_alloc(NULL, sizeof(dump_keys)) );
+	for (i = 0; dump_keys[i]; i++) {
+		if (strncmp(dump_keys[i], controller, strlen(controller)) == 0 &&
+				dump_keys[i][strlen(controller)] == '.')
+			keys[nkeys++] = dump_keys[i];
+	}
+
+	out = NIH_MUST( nih_strdup(parent, "") );
+	level = NIH_MUST( nih_str_array_new(NULL) );
+	n = 0;
+	NIH_MUST( nih_str_array_add(&level, NULL, &n, "/") );
+	while (n) {
+		nih_local struct cgm_batch *b = NULL;
+		nih_local char ***children = NULL;
+		nih_local char **values = NULL;
+
+		children = NIH_MUST( nih_alloc(NULL, n * sizeof(char **)) );
+		values = NIH_MUST( nih_alloc(NULL, (n * nkeys + 1) * sizeof(char *)) );
+		b = cgm_batch_new();
+		/* cgroups may go away while we walk */
+		cgm_batch_quiet(b, true);
+		for (i = 0; i < n; i++) {
+			cgm_batch_list_children(b, controller, level[i], &children[i]);
+			for (k = 0; k < nkeys; k++)
+				cgm_batch_get_value(b, controller, level[i], keys[k],
+						&values[i * nkeys + k]);
+		}
+		cgm_batch_run(b);
+
+		next = NIH_MUST( nih_str_array_new(NULL) );
+		nnext = 0;
+		for (i = 0; i < n; i++) {
+			if (!children[i])
+				continue;
+			NIH_MUST( nih_strcat_sprintf(&out, parent, "%s%s\n",
+					strcmp(level[i], "/") ? "/" : "", level[i]) );
+			for (k = 0; k < nkeys; k++) {
+				const char *v = values[i * nkeys + k];
+
+				if (!v)
+					continue;
+				NIH_MUST( nih_strcat_sprintf(&out, parent, "%s %.*s\n", keys[k],
+						(int) strcspn(v, "\n"), v) );
+			}
+			for (j = 0; children[i][j]; j++) {
+				nih_local char *cg = NULL;
+
+				if (strcmp(level[i], "/") == 0)
+					cg = NIH_MUST( nih_strdup(NULL, children[i][j]) );
+				else
+					cg = NIH_MUST( nih_sprintf(NULL, "%s/%s", level[i], children[i][j]) );
+				NIH_MUST( nih_str_array_add(&next, NULL, &nnext, cg) );
+			}
+		}
+		nih_free(level);
+		level = next;
+		n = nnext;
+	}
+	nih_free(level);
+	return out;
+}
+
+static int lx_getattr(const char *path, struct stat *sb)
+{
+	struct timespec now;
+
+	memset(sb, 0, sizeof(struct stat));
+	if (clock_gettime(CLOCK_REALTIME, &now) < 0)
+		return -EINVAL;
+	sb->st_atim = sb->st_mtim = sb->st_ctim = now;
+
+	if (strcmp(path, "/lxcfs") == 0) {
+		sb->st_mode = S_IFDIR | 00755;
+		sb->st_nlink = 2;
+		return 0;
+	}
+	if (strcmp(path, "/lxcfs/dump") == 0) {
+		sb->st_mode = S_IFDIR | 00755;
+		sb->st_nlink = 2;
+		return 0;
+	}
+	if (strcmp(path, "/lxcfs/stats") == 0 || dump_controller(path)) {
+		sb->st_mode = S_IFREG | 00400;
+		sb->st_nlink = 1;
+		return 0;
+	}
+	return -ENOENT;
+}
+
+static int lx_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+		struct fuse_file_info *fi)
+{
+	char **list = LXCFS_DATA ? LXCFS_DATA->subsystems : NULL;
+	int i;
+
+	if (strcmp(path, "/lxcfs/dump") == 0) {
+		for (i = 0; list && list[i]; i++) {
+			if (filler(buf, list[i], NULL, 0) != 0)
+				return -EINVAL;
+		}
+		return 0;
+	}
+	if (filler(buf, "stats", NULL, 0) != 0 || filler(buf, "dump", NULL, 0) != 0)
+		return -EINVAL;
+	return 0;
+}
+
+/*
+ * The contents are rendered once at open, so that reading them in
+ * several chunks gives a consistent snapshot.
+ */
+static int lx_open(const char *path, struct fuse_file_info *fi)
+{
+	struct fuse_context *fc = lxcfs_get_context();
+	struct lxcfs_handle *h;
+	const char *controller = dump_controller(path);
+
+	if (strcmp(path, "/lxcfs/stats") != 0 && !controller)
+		return -ENOENT;
+	if (fc->uid != 0 || (fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+
+	h = handle_new();
+	if (controller)
+		h->buf = dump_render(h, controller);
+	else
+		h->buf = stats_render(h);
+	h->size = strlen(h->buf);
+	h->filled = true;
+	fi->fh = h->fh;
+	fi->direct_io = 1;
+	return 0;
+}
+
+static int lx_read(const char *path, char *buf, size_t size, off_t offset,
+		struct fuse_file_info *fi)
+{
+	return handle_read(fi->fh, buf, size, offset);
+}
+
+static int lx_release(const char *path, struct fuse_file_info *fi)
+{
+	handle_free(fi->fh);
+	return 0;
+}
+
+/*
+ * FUSE ops for /
+ * these just delegate to the /proc and /cgroup ops as
+ * needed
+ */
+
+static int lxcfs_getattr(const char *path, struct stat *sb)
+{
+	uint64_t start = stats_now();
+	int ret;
+
+	if (strcmp(path, "/") == 0) {
+		sb->st_mode = S_IFDIR | 00755;
+		sb->st_nlink = 2;
+		return 0;
+	}
+	if (strncmp(path, "/cgroup", 7) == 0) {
+		ret = cg_getattr(path, sb);
+		stats_op(STATS_GETATTR, STATS_CGROUP, start, ret);
+		return ret;
+	}
+	if (strncmp(path, "/proc", 5) == 0) {
+		ret = proc_getattr(path, sb);
+		stats_op(STATS_GETATTR, STATS_PROC, start, ret);
+		return ret;
+	}
+	if (strncmp(path, "/sys", 4) == 0) {
+		ret = sys_getattr(path, sb);
+		stats_op(STATS_GETATTR, STATS_SYS, start, ret);
+		return ret;
+	}
+	if (strncmp(path, "/lxcfs", 6) == 0)
+		return lx_getattr(path, sb);
+	return -EINVAL;
+}
+
+static int lxcfs_opendir(const char *path, struct fuse_file_info *fi)
+{
+	if (strcmp(path, "/") == 0)
+		return 0;
+
+	if (strncmp(path, "/cgroup", 7) == 0) {
+		return cg_opendir(path, fi);
+	}
+	if (strcmp(path, "/proc") == 0 || strcmp(path, "/lxcfs") == 0 ||
+			strcmp(path, "/lxcfs/dump") == 0 || is_sys_dir(path))
+		return 0;
+	return -ENOENT;
+}
+
+static int lxcfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+		struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now();
+	int ret;
+
+	if (strcmp(path, "/") == 0) {
+		if (filler(buf, "proc", NULL, 0) != 0 ||
+				filler(buf, "cgroup", NULL, 0) != 0 ||
+				filler(buf, "sys", NULL, 0) != 0 ||
+				filler(buf, "lxcfs", NULL, 0) != 0)
+			return -EINVAL;
+		return 0;
+	}
+	if (strncmp(path, "/cgroup", 7) == 0) {
+		ret = cg_readdir(path, buf, filler, offset, fi);
+		stats_op(STATS_READDIR, STATS_CGROUP, start, ret);
+		return ret;
+	}
+	if (strcmp(path, "/proc") == 0) {
+		ret = proc_readdir(path, buf, filler, offset, fi);
+		stats_op(STATS_READDIR, STATS_PROC, start, ret);
+		return ret;
+	}
+	if (is_sys_dir(path)) {
+		ret = sys_readdir(path, buf, filler, offset, fi);
+		stats_op(STATS_READDIR, STATS_SYS, start, ret);
+		return ret;
+	}
+	if (strcmp(path, "/lxcfs") == 0 || strcmp(path, "/lxcfs/dump") == 0)
+		return lx_readdir(path, buf, filler, offset, fi);
+	return -EINVAL;
+}
+
+static int lxcfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	if (strcmp(path, "/") == 0)
+		return 0;
+	if (strncmp(path, "/cgroup", 7) == 0) {
+		return cg_releasedir(path, fi);
+	}
+	if (strcmp(path, "/proc") == 0 || strcmp(path, "/lxcfs") == 0 ||
+			strcmp(path, "/lxcfs/dump") == 0 || is_sys_dir(path))
+		return 0;
+	return -EINVAL;
+}
+
+static int lxcfs_open(const char *path, struct fuse_file_info *fi)
+{
+	if (strncmp(path, "/cgroup", 7) == 0)
+		return cg_open(path, fi);
+	if (strncmp(path, "/proc", 5) == 0)
+		return proc_open(path, fi);
+	if (strncmp(path, "/sys", 4) == 0)
+		return sys_open(path, fi);
+	if (strncmp(path, "/lxcfs", 6) == 0)
+		return lx_open(path, fi);
+
+	return -EINVAL;
+}
+
+static int lxcfs_read(const char *path, char *buf, size_t size, off_t offset,
+		struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now();
+	int ret;
+
+	if (strncmp(path, "/cgroup", 7) == 0) {
+		ret = cg_read(path, buf, size, offset, fi);
+		stats_op(STATS_READ, STATS_CGROUP, start, ret);
+		return ret;
+	}
+	if (strncmp(path, "/proc", 5) == 0) {
+		ret = proc_read(path, buf, size, offset, fi);
+		stats_op(STATS_READ, STATS_PROC, start, ret);
+		return ret;
+	}
+	if (strncmp(path, "/sys", 4) == 0) {
+		ret = sys_read(path, buf, size, offset, fi);
+		stats_op(STATS_READ, STATS_SYS, start, ret);
+		return ret;
+	}
+	if (strncmp(path, "/lxcfs", 6) == 0)
+		return lx_read(path, buf, size, offset, fi);
+
+	return -EINVAL;
+}
+
+int lxcfs_write(const char *path, const char *buf, size_t size, off_t offset,
+	     struct fuse_file_info *fi)
+{
+	uint64_t start = stats_now();
+	int ret;
+
+	if (strncmp(path, "/cgroup", 7) == 0) {
+		ret = cg_write(path, buf, size, offset, fi);
+		stats_op(STATS_WRITE, STATS_CGROUP, start, ret);
+		return ret;
+	}
+
+	return -EINVAL;
+}
+
+static int lxcfs_flush(const char *path, struct fuse_file_info *fi)
+{
+	return 0;
+}
+
+static int lxcfs_release(const char *path, struct fuse_file_info *fi)
+{
+	if (strncmp(path, "/cgroup", 7) == 0)
+		return cg_release(path, fi);
+	if (strncmp(path, "/lxcfs", 6) == 0)
+		return lx_release(path, fi);
+	return 0;
+}
+
+static int lxcfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	return 0;
+}
+
+int lxcfs_mkdir(const char *path, mode_t mode)
+{
+	if (strncmp(path, "/cgroup", 7) == 0)
+		return cg_mkdir(path, mode);
+
+	return -EINVAL;
+}
+
+int lxcfs_chown(const char *path, uid_t uid, gid_t gid)
+{
+	if (strncmp(path, "/cgroup", 7) == 0)
+		return cg_chown(path, uid, gid);
+
+	return -EINVAL;
+}
+
+/*
+ * cat first does a truncate before doing ops->write.  This doesn't
+ * really make sense for cgroups.  So just return 0 always but do
+ * nothing.
+ */
+int lxcfs_truncate(const char *path, off_t newsize)
+{
+	if (strncmp(path, "/cgroup", 7) == 0)
+		return 0;
+	return -EINVAL;
+}
+
+int lxcfs_rmdir(const char *path)
+{
+	if (strncmp(path, "/cgroup", 7) == 0)
+		return cg_rmdir(path);
+	return -EINVAL;
+}
+
+int lxcfs_chmod(const char *path, mode_t mode)
+{
+	if (strncmp(path, "/cgroup", 7) == 0)
+		return cg_chmod(path, mode);
+	return -EINVAL;
+}
+
+const struct fuse_operations lxcfs_ops = {
+	.getattr = lxcfs_getattr,
+	.readlink = NULL,
+	.getdir = NULL,
+	.mknod = NULL,
+	.mkdir = lxcfs_mkdir,
+	.unlink = NULL,
+	.rmdir = lxcfs_rmdir,
+	.symlink = NULL,
+	.rename = NULL,
+	.link = NULL,
+	.chmod = lxcfs_chmod,
+	.chown = lxcfs_chown,
+	.truncate = lxcfs_truncate,
+	.utime = NULL,
+
+	.open = lxcfs_open,
+	.read = lxcfs_read,
+	.release = lxcfs_release,
+	.write = lxcfs_write,
+
+	.statfs = NULL,
+	.flush = lxcfs_flush,
+	.fsync = lxcfs_fsync,
+
+	.setxattr = NULL,
+	.getxattr = NULL,
+	.listxattr = NULL,
+	.removexattr = NULL,
+
+	.opendir = lxcfs_opendir,
+	.readdir = lxcfs_readdir,
+	.releasedir = lxcfs_releasedir,
+
+	.fsyncdir = NULL,
+	.init = NULL,
+	.destroy = NULL,
+	.access = NULL,
+	.create = NULL,
+	.ftruncate = NULL,
+	.fgetattr = NULL,
+};
+
+/*
+ * fuse lowlevel glue.
+ *
+ * The kernel refers to everything we have looked up by inode number.
+ * Each inode maps to an lxcfs_node, which remembers the path and, for
+ * the /cgroup tree, the controller, cgroup and key which it resolved
+ * to when it was looked up.  A node lives from its first lookup until
+ * the kernel forgets all lookups of it.  The nodes are handed to the
+ * path-based lxcfs_ops above to do the actual work.
+ */
+struct lxcfs_node {
+	fuse_ino_t ino;
+	char *path;
+	char *controller;	/* NULL outside of /cgroup/$controller */
+	char *cgroup;		/* cgroup under the controller, or NULL */
+	char *key;		/* cgroup file, or NULL for directories */
+	unsigned long nlookup;
+	struct lxcfs_node *ino_next, *path_next;
+};
+
+#define NODE_HASH_SIZE 4096
+static struct lxcfs_node *node_ino_hash[NODE_HASH_SIZE];
+static struct lxcfs_node *node_path_hash[NODE_HASH_SIZE];
+static fuse_ino_t next_ino = FUSE_ROOT_ID + 1;
+/* lookups and invalidations share the table, forget and new nodes need it alone */
+static pthread_rwlock_t node_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* the channel to the kernel, for sending invalidations */
+static struct fuse_chan *lxcfs_chan;
+
+static struct lxcfs_node *node_by_ino_locked(fuse_ino_t ino)
+{
+	struct lxcfs_node *n;
+
+	for (n = node_ino_hash[ino % NODE_HASH_SIZE]; n; n = n->ino_next) {
+		if (n->ino == ino)
+			return n;
+	}
+	return NULL;
+}
+
+static struct lxcfs_node *node_by_path_locked(const char *path)
+{
+	struct lxcfs_node *n;
+
+	for (n = node_path_hash[str_hash(path) % NODE_HASH_SIZE]; n; n = n->path_next) {
+		if (strcmp(n->path, path) == 0)
+			return n;
+	}
+	return NULL;
+}
+
+/*
+ * Return a nih_alloc'd copy of the path of @ino, or NULL if we don't
+ * know that inode.  We return a copy since the node may be forgotten
+ * while the caller is using it.
+ */
+static char *node_path(fuse_ino_t ino)
+{
+	struct lxcfs_node *n;
+	char *path = NULL;
+
+	pthread_rwlock_rdlock(&node_lock);
+	n = node_by_ino_locked(ino);
+	if (n)
+		path = NIH_MUST( nih_strdup(NULL, n->path) );
+	pthread_rwlock_unlock(&node_lock);
+	return path;
+}
+
+static char *node_child_path(fuse_ino_t parent, const char *name)
+{
+	nih_local char *ppath = node_path(parent);
+
+	if (!ppath)
+		return NULL;
+	if (strcmp(ppath, "/") == 0)
+		return NIH_MUST( nih_sprintf(NULL, "/%s", name) );
+	return NIH_MUST( nih_sprintf(NULL, "%s/%s", ppath, name) );
+}
+
+/*
+ * Fill in the controller, cgroup and key for a node under /cgroup.
+ * /cgroup/memory/a/b is the cgroup a/b if b is a directory, or the
+ * key b in cgroup a otherwise.  The root cgroup is "/".
+ */
+static void node_resolve(struct lxcfs_node *n, bool isdir)
+{
+	const char *p, *slash;
+
+	if (strncmp(n->path, "/cgroup/", 8) != 0)
+		return;
+	p = n->path + 8;
+	slash = strchr(p, '/');
+	if (!slash) {
+		n->controller = NIH_MUST( nih_strdup(n, p) );
+		n->cgroup = NIH_MUST( nih_strdup(n, "/") );
+		return;
+	}
+	n->controller = NIH_MUST( nih_strndup(n, p, slash - p) );
+	p = slash + 1;
+	if (isdir) {
+		n->cgroup = NIH_MUST( nih_strdup(n, p) );
+		return;
+	}
+	slash = strrchr(p, '/');
+	if (!slash) {
+		n->cgroup = NIH_MUST( nih_strdup(n, "/") );
+		n->key = NIH_MUST( nih_strdup(n, p) );
+	} else {
+		n->cgroup = NIH_MUST( nih_strndup(n, p, slash - p) );
+		n->key = NIH_MUST( nih_strdup(n, slash + 1) );
+	}
+}
+
+static struct lxcfs_node *node_insert_locked(fuse_ino_t ino, const char *path, bool isdir)
+{
+	struct lxcfs_node *n;
+	unsigned int h;
+
+	n = NIH_MUST( nih_new(NULL, struct lxcfs_node) );
+	memset(n, 0, sizeof(*n));
+	n->ino = ino;
+	n->path = NIH_MUST( nih_strdup(n, path) );
+	node_resolve(n, isdir);
+	h = n->ino % NODE_HASH_SIZE;
+	n->ino_next = node_ino_hash[h];
+	node_ino_hash[h] = n;
+	h = str_hash(path) % NODE_HASH_SIZE;
+	n->path_next = node_path_hash[h];
+	node_path_hash[h] = n;
+	return n;
+}
+
+/*
+ * Find or create the node for @path and take a lookup reference on it.
+ */
+static fuse_ino_t node_lookup(const char *path, const struct stat *sb)
+{
+	struct lxcfs_node *n;
+	fuse_ino_t ino;
+
+	pthread_rwlock_rdlock(&node_lock);
+	n = node_by_path_locked(path);
+	if (n) {
+		ino = n->ino;
+		__sync_add_and_fetch(&n->nlookup, 1);
+		pthread_rwlock_unlock(&node_lock);
+		stats_inc(STATS_NODE_HIT);
+		return ino;
+	}
+	pthread_rwlock_unlock(&node_lock);
+
+	pthread_rwlock_wrlock(&node_lock);
+	n = node_by_path_locked(path);
+	if (!n) {
+		stats_inc(STATS_NODE_MISS);
+		n = node_insert_locked(next_ino++, path, S_ISDIR(sb->st_mode));
+	}
+	n->nlookup++;
+	ino = n->ino;
+	pthread_rwlock_unlock(&node_lock);
+	return ino;
+}
+
+static void node_forget(fuse_ino_t ino, unsigned long nlookup)
+{
+	struct lxcfs_node *n, **np;
+
+	if (ino == FUSE_ROOT_ID)
+		return;
+
+	pthread_rwlock_wrlock(&node_lock);
+	n = node_by_ino_locked(ino);
+	if (!n)
+		goto out;
+	if (n->nlookup > nlookup) {
+		n->nlookup -= nlookup;
+		goto out;
+	}
+	for (np = &node_ino_hash[ino % NODE_HASH_SIZE]; *np != n; np = &(*np)->ino_next)
+		;
+	*np = n->ino_next;
+	for (np = &node_path_hash[str_hash(n->path) % NODE_HASH_SIZE]; *np != n; np = &(*np)->path_next)
+		;
+	*np = n->path_next;
+	nih_free(n);
+out:
+	pthread_rwlock_unlock(&node_lock);
+}
+
+static void ino_list_add(fuse_ino_t **list, size_t *n, fuse_ino_t ino)
+{
+	*list = NIH_MUST( nih_realloc(*list, NULL, (*n + 1) * sizeof(fuse_ino_t)) );
+	(*list)[(*n)++] = ino;
+}
+
+/*
+ * Tell the kernel to drop its cached attributes for path, and if tree is
+ * true, its dentry for path and the attributes of all nodes below it.
+ * Must not be called while the kernel waits on a reply for path's parent.
+ */
+static void node_invalidate(const char *path, bool tree)
+{
+	nih_local fuse_ino_t *inos = NULL;
+	nih_local char *ppath = NULL;
+	struct lxcfs_node *n;
+	fuse_ino_t parent = 0;
+	size_t plen = strlen(path), ninos = 0, i;
+	const char *name = NULL;
+
+	if (!lxcfs_chan)
+		return;
+
+	pthread_rwlock_rdlock(&node_lock);
+	if ((n = node_by_path_locked(path)) != NULL)
+		ino_list_add(&inos, &ninos, n->ino);
+	if (tree) {
+		for (i = 0; i < NODE_HASH_SIZE; i++) {
+			for (n = node_ino_hash[i]; n; n = n->ino_next) {
+				if (strncmp(n->path, path, plen) == 0 && n->path[plen] == '/')
+					ino_list_add(&inos, &ninos, n->ino);
+			}
+		}
+		name = strrchr(path, '/');
+		if (name && name[1]) {
+			if (name == path)
+				ppath = NIH_MUST( nih_strdup(NULL, "/") );
+			else
+				ppath = NIH_MUST( nih_strndup(NULL, path, name - path) );
+			name++;
+			if ((n = node_by_path_locked(ppath)) != NULL)
+				parent = n->ino;
+		}
+	}
+	pthread_rwlock_unlock(&node_lock);
+
+	for (i = 0; i < ninos; i++)
+		fuse_lowlevel_notify_inval_inode(lxcfs_chan, inos[i], -1, 0);
+	if (parent)
+		fuse_lowlevel_notify_inval_entry(lxcfs_chan, parent, name, strlen(name));
+}
+
+/*
+ * Tell the kernel to drop its dentry for path, and path's attributes,
+ * without looking at what is below it.  Enough when path was created or
+ * removed: the kernel forgets the nodes below a dentry it drops.
+ */
+static void node_invalidate_entry(const char *path)
+{
+	nih_local char *ppath = NULL;
+	struct lxcfs_node *n;
+	fuse_ino_t ino = 0, parent = 0;
+	const char *name = strrchr(path, '/');
+
+	if (!lxcfs_chan || !name || !name[1])
+		return;
+	if (name == path)
+		ppath = NIH_MUST( nih_strdup(NULL, "/") );
+	else
+		ppath = NIH_MUST( nih_strndup(NULL, path, name - path) );
+	name++;
+
+	pthread_rwlock_rdlock(&node_lock);
+	if ((n = node_by_path_locked(path)) != NULL)
+		ino = n->ino;
+	if ((n = node_by_path_locked(ppath)) != NULL)
+		parent = n->ino;
+	pthread_rwlock_unlock(&node_lock);
+
+	if (ino)
+		fuse_lowlevel_notify_inval_inode(lxcfs_chan, ino, -1, 0);
+	if (parent)
+		fuse_lowlevel_notify_inval_entry(lxcfs_chan, parent, name, strlen(name));
+}
+
+/* send the invalidations queued up by the request we just answered */
+static void ll_send_invalidations(void)
+{
+	struct lxcfs_inval *i, *next;
+
+	for (i = lxcfs_pending_inval; i; i = next) {
+		next = i->next;
+		node_invalidate(i->path, i->tree);
+		nih_free(i);
+	}
+	lxcfs_pending_inval = NULL;
+}
+
+/*
+ * Called from the cgroup watcher when a cgroup changed behind our back.
+ * Only what changed is invalidated: a write to a file only makes its own
+ * attributes stale, a new or removed cgroup only its entry in the parent.
+ */
+static void cg_changed(const char *controller, const char *cgroup,
+		const char *name, enum cgwatch_change change)
+{
+	nih_local char *path = NULL;
+
+	path = NIH_MUST( nih_sprintf(NULL, "/cgroup/%s", controller) );
+	if (strcmp(cgroup, "/") != 0)
+		NIH_MUST( nih_strcat_sprintf(&path, NULL, "/%s", cgroup) );
+	if (name)
+		NIH_MUST( nih_strcat_sprintf(&path, NULL, "/%s", name) );
+
+	switch (change) {
+	case CGWATCH_ATTRS:
+		node_invalidate(path, false);
+		break;
+	case CGWATCH_ENTRY:
+		node_invalidate_entry(path);
+		break;
+	case CGWATCH_ALL:
+		node_invalidate(path, true);
+		break;
+	}
+}
+
+static void node_init(void)
+{
+	struct lxcfs_node *n;
+
+	n = node_insert_locked(FUSE_ROOT_ID, "/", true);
+	n->nlookup = 1;
+}
+
+/*
+ * The threads serving requests.  The main thread reads requests from the
+ * kernel and queues them by tenant, and the workers take them from there
+ * in a fair order (see below).  With a single thread, the main thread
+ * serves each request itself as soon as it has read it.  Each worker has
+ * its own cgmanager connection (see cgmanager.c), its own scratch arena
+ * for building replies, and its own counters.
+ */
+struct lxcfs_worker {
+	int id;
+	pthread_t thread;
+	struct fuse_session *se;
+	char *buf;		/* the request being read, main thread only */
+	size_t bufsize;
+	char *arena;		/* scratch space for replies */
+	size_t arena_size;
+	unsigned long requests;
+};
+
+static struct lxcfs_worker *workers;
+static unsigned int nr_workers;
+static __thread struct lxcfs_worker *self_worker;
+
+/* struct fuse_in_header from linux/fuse.h, which every request starts with */
+struct ll_in_header {
+	uint32_t len, opcode;
+	uint64_t unique, nodeid;
+	uint32_t uid, gid, pid, padding;
+};
+
+/*
+ * The kernel's INIT request, which is the first one on a mount.  We keep
+ * it for the lxcfs which takes over from us in an upgrade.
+ */
+static char *fuse_init_req;
+static size_t fuse_init_len;
+#define FUSE_INIT_OPCODE 26
+
+static void save_init(const char *buf, size_t len)
+{
+	struct ll_in_header in;
+
+	memcpy(&in, buf, sizeof(in));
+	if (in.opcode != FUSE_INIT_OPCODE)
+		return;
+	fuse_init_req = NIH_MUST( nih_alloc(NULL, len) );
+	memcpy(fuse_init_req, buf, len);
+	fuse_init_len = len;
+}
+
+/*
+ * Return at least size bytes of scratch space, valid until the calling
+ * worker's next request.
+ */
+static char *worker_arena(size_t size)
+{
+	struct lxcfs_worker *w = self_worker;
+	char *p;
+
+	if (size <= w->arena_size)
+		return w->arena;
+	if (!(p = realloc(w->arena, size)))
+		return NULL;
+	w->arena = p;
+	w->arena_size = size;
+	return p;
+}
+
+/*
+ * Fair scheduling between containers.  Each request goes on the queue of
+ * its tenant, which is the set of cgroups the caller is in, and workers
+ * take requests from the tenants in deficit round robin order: a tenant
+ * is served while it has credit, and each round gives the tenants with
+ * requests waiting SCHED_QUANTUM more.  A request costs the time it took
+ * to serve, so a container whose reads fork helpers or wait on timeouts
+ * runs out of credit sooner than one whose reads are cheap.  A tenant may
+ * also only keep half the workers busy at once, so that its slow requests
+ * can't hold up everyone else's.
+ */
+#define SCHED_QUANTUM 1000000ULL		/* ns of service per round */
+#define SCHED_MAX_DEBT (100 * SCHED_QUANTUM)
+#define TENANT_HASH_SIZE 256
+#define TENANT_IDLE 10000000000ULL		/* ns before an idle tenant is dropped */
+
+struct lxcfs_request {
+	size_t len;
+	struct fuse_chan *ch;
+	struct lxcfs_request *next;
+	char buf[];
+};
+
+struct lxcfs_tenant {
+	uint64_t key;
+	struct lxcfs_request *head, **tail;
+	int64_t deficit;
+	unsigned int inflight;
+	uint64_t last_used;
+	struct lxcfs_tenant *hash_next;
+	struct lxcfs_tenant *next, *prev;	/* on the round, while it has requests */
+};
+
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+static struct lxcfs_tenant *tenant_hash[TENANT_HASH_SIZE];
+static struct lxcfs_tenant *sched_round;	/* the tenant whose turn it is */
+static unsigned int sched_queued;
+static unsigned int sched_max_inflight;
+static bool sched_stopping;
+static uint64_t sched_last_gc;
+
+/*
+ * Tenants are told apart by a hash of the caller's /proc/<pid>/cgroup,
+ * which we remember per pid for a second.  This is only ever used by the
+ * main thread.  Requests the kernel makes on its own, such as forgets,
+ * have no pid and make up a tenant of their own.
+ *
+ * Reading the file costs the thread which reads all requests a few
+ * microseconds for each pid it hasn't seen lately, which is cheap next to
+ * the request itself but would let a container spawning pids as fast as
+ * it can slow everyone's requests down before they are even queued.  So
+ * only PID_LOOKUPS_MAX pids are looked up a second; requests from the
+ * rest until then go to a tenant of their own, TENANT_UNCLASSIFIED.
+ */
+#define PID_CACHE_SIZE 1024
+#define PID_CACHE_TIME 1000000000ULL
+#define PID_LOOKUPS_MAX 1000
+#define TENANT_UNCLASSIFIED 1
+
+static struct pid_tenant {
+	pid_t pid;
+	uint64_t key;
+	uint64_t expires;
+} pid_cache[PID_CACHE_SIZE];
+
+static unsigned int pid_lookups;
+static uint64_t pid_lookups_reset;
+
+static uint64_t tenant_key(pid_t pid, uint64_t now)
+{
+	struct pid_tenant *c = &pid_cache[pid % PID_CACHE_SIZE];
+	char path[40], buf[4096];
+	uint64_t key = 14695981039346656037ULL;
+	ssize_t len, i;
+	int fd;
+
+	if (pid <= 0)
+		return 0;
+	if (c->pid == pid && c->expires > now)
+		return c->key;
+
+	if (now - pid_lookups_reset > PID_CACHE_TIME) {
+		pid_lookups = 0;
+		pid_lookups_reset = now;
+	}
+	if (pid_lookups >= PID_LOOKUPS_MAX)
+		return TENANT_UNCLASSIFIED;
+	pid_lookups++;
+
+	snprintf(path, sizeof(path), "/proc/%d/cgroup", pid);
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+	len = read(fd, buf, sizeof(buf));
+	close(fd);
+	if (len <= 0)
+		return 0;
+	for (i = 0; i < len; i++)
+		key = (key ^ (unsigned char) buf[i]) * 1099511628211ULL;
+	if (key <= TENANT_UNCLASSIFIED)
+		key = TENANT_UNCLASSIFIED + 1;
+
+	c->pid = pid;
+	c->key = key;
+	c->expires = now + PID_CACHE_TIME;
+	return key;
+}
+
+static void round_add_locked(struct lxcfs_tenant *t)
+{
+	if (!sched_round) {
+		t->next = t->prev = t;
+		sched_round = t;
+		return;
+	}
+	/* at the end of the round, just before whoever's turn it is */
+	t->next = sched_round;
+	t->prev = sched_round->prev;
+	t->prev->next = t;
+	sched_round->prev = t;
+}
+
+static void round_remove_locked(struct lxcfs_tenant *t)
+{
+	if (t->next == t) {
+		sched_round = NULL;
+	} else {
+		t->prev->next = t->next;
+		t->next->prev = t->prev;
+		if (sched_round == t)
+			sched_round = t->next;
+	}
+	t->next = t->prev = NULL;
+	/* credit is not kept over idle times, debt is */
+	if (t->deficit > 0)
+		t->deficit = 0;
+}
+
+static struct lxcfs_tenant *tenant_get_locked(uint64_t key)
+{
+	struct lxcfs_tenant *t;
+	unsigned int h = key % TENANT_HASH_SIZE;
+
+	for (t = tenant_hash[h]; t; t = t->hash_next) {
+		if (t->key == key)
+			return t;
+	}
+	t = NIH_MUST( nih_new(NULL, struct lxcfs_tenant) );
+	memset(t, 0, sizeof(*t));
+	t->key = key;
+	t->tail = &t->head;
+	t->hash_next = tenant_hash[h];
+	tenant_hash[h] = t;
+	return t;
+}
+
+/* forget about tenants which have been idle for a while */
+static void tenant_gc_locked(uint64_t now)
+{
+	struct lxcfs_tenant *t, **tp;
+	int i;
+
+	for (i = 0; i < TENANT_HASH_SIZE; i++) {
+		tp = &tenant_hash[i];
+		while ((t = *tp)) {
+			if (!t->head && !t->inflight && now - t->last_used > TENANT_IDLE) {
+				*tp = t->hash_next;
+				nih_free(t);
+			} else
+				tp = &t->hash_next;
+		}
+	}
+	sched_last_gc = now;
+}
+
+static void sched_enqueue(uint64_t key, const char *buf, size_t len,
+		struct fuse_chan *ch, uint64_t now)
+{
+	struct lxcfs_request *r;
+	struct lxcfs_tenant *t;
+
+	r = NIH_MUST( nih_alloc(NULL, sizeof(*r) + len) );
+	memcpy(r->buf, buf, len);
+	r->len = len;
+	r->ch = ch;
+	r->next = NULL;
+
+	pthread_mutex_lock(&sched_lock);
+	if (now - sched_last_gc > TENANT_IDLE)
+		tenant_gc_locked(now);
+	t = tenant_get_locked(key);
+	t->last_used = now;
+	if (!t->head)
+		round_add_locked(t);
+	*t->tail = r;
+	t->tail = &r->next;
+	sched_queued++;
+	pthread_cond_signal(&sched_cond);
+	pthread_mutex_unlock(&sched_lock);
+}
+
+/* take the next request in the round, or NULL if none may be served now */
+static struct lxcfs_request *sched_pick_locked(struct lxcfs_tenant **tp)
+{
+	struct lxcfs_request *r;
+	struct lxcfs_tenant *t;
+	bool eligible = false;
+
+	if (!sched_round)
+		return NULL;
+	t = sched_round;
+	do {
+		if (t->inflight < sched_max_inflight)
+			eligible = true;
+		t = t->next;
+	} while (!eligible && t != sched_round);
+	if (!eligible)
+		return NULL;
+
+	for (;;) {
+		t = sched_round;
+		if (t->inflight < sched_max_inflight) {
+			if (t->deficit > 0)
+				break;
+			t->deficit += SCHED_QUANTUM;
+		}
+		sched_round = t->next;
+	}
+
+	r = t->head;
+	if (!(t->head = r->next)) {
+		t->tail = &t->head;
+		round_remove_locked(t);
+	}
+	t->inflight++;
+	sched_queued--;
+	*tp = t;
+	return r;
+}
+
+/* wait for a request to serve, or return NULL once we are stopping and all are served */
+static struct lxcfs_request *sched_next(struct lxcfs_tenant **tp)
+{
+	struct lxcfs_request *r;
+
+	pthread_mutex_lock(&sched_lock);
+	while (!(r = sched_pick_locked(tp)) && !(sched_stopping && !sched_queued))
+		pthread_cond_wait(&sched_cond, &sched_lock);
+	if (sched_stopping && !sched_queued)
+		pthread_cond_broadcast(&sched_cond);
+	pthread_mutex_unlock(&sched_lock);
+	return r;
+}
+
+static void sched_done(struct lxcfs_tenant *t, uint64_t cost)
+{
+	pthread_mutex_lock(&sched_lock);
+	t->inflight--;
+	t->deficit -= cost;
+	if (t->deficit < -(int64_t) SCHED_MAX_DEBT)
+		t->deficit = -(int64_t) SCHED_MAX_DEBT;
+	/* it may have been held back by its limit on workers */
+	if (t->head)
+		pthread_cond_signal(&sched_cond);
+	pthread_mutex_unlock(&sched_lock);
+}
+
+static void *worker_loop(void *arg)
+{
+	struct lxcfs_worker *w = arg;
+	struct lxcfs_request *r;
+	struct lxcfs_tenant *t;
+	sigset_t sigs;
+	uint64_t start;
+
+	self_worker = w;
+	/* leave the signals to the main thread */
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	while ((r = sched_next(&t))) {
+		start = stats_now();
+		w->requests++;
+		fuse_session_process(w->se, r->buf, r->len, r->ch);
+		sched_done(t, stats_now() - start);
+		nih_free(r);
+	}
+	return NULL;
+}
+
+/*
+ * Read requests until the filesystem is unmounted or we are told to exit,
+ * and queue them for the workers, or serve them right away if there are
+ * none.
+ */
+static int read_requests(struct lxcfs_worker *w)
+{
+	struct fuse_chan *ch = fuse_session_next_chan(w->se, NULL);
+	struct ll_in_header in;
+	uint64_t now;
+	int res = 0;
+
+	self_worker = w;
+	while (!fuse_session_exited(w->se)) {
+		struct fuse_chan *tmpch = ch;
+
+		res = fuse_chan_recv(&tmpch, w->buf, w->bufsize);
+		if (res == -EINTR)
+			continue;
+		if (res <= 0)
+			break;
+		if (!fuse_init_req)
+			save_init(w->buf, res);
+		if (!nr_workers) {
+			w->requests++;
+			fuse_session_process(w->se, w->buf, res, tmpch);
+			continue;
+		}
+		memcpy(&in, w->buf, sizeof(in));
+		now = stats_now();
+		sched_enqueue(tenant_key(in.pid, now), w->buf, res, tmpch, now);
+	}
+	fuse_session_exit(w->se);
+	return res < 0 ? -1 : 0;
+}
+
+/*
+ * Serve requests with n threads until the filesystem is unmounted or we
+ * are told to exit.  The calling thread reads them, and serves them too
+ * if n is 1.  Requests which were read are all served before we return.
+ */
+static int run_workers(struct fuse_session *se, unsigned int n)
+{
+	struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
+	unsigned int i;
+	int ret;
+
+	workers = calloc(n + 1, sizeof(*workers));
+	if (!workers)
+		return -1;
+	for (i = 0; i <= n; i++) {
+		workers[i].id = i;
+		workers[i].se = se;
+	}
+	workers[0].bufsize = fuse_chan_bufsize(ch);
+	workers[0].buf = malloc(workers[0].bufsize);
+	if (!workers[0].buf) {
+		fprintf(stderr, "Failed to allocate request buffer\n");
+		free(workers);
+		return -1;
+	}
+
+	nr_workers = 0;
+	sched_stopping = false;
+	for (i = 1; n > 1 && i <= n; i++) {
+		if (pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]) != 0) {
+			fprintf(stderr, "Failed to start worker %u, running with %u\n", i, i - 1);
+			break;
+		}
+		nr_workers++;
+	}
+	sched_max_inflight = (nr_workers + 1) / 2;
+
+	ret = read_requests(&workers[0]);
+
+	pthread_mutex_lock(&sched_lock);
+	sched_stopping = true;
+	pthread_cond_broadcast(&sched_cond);
+	pthread_mutex_unlock(&sched_lock);
+	for (i = 1; i <= nr_workers; i++)
+		pthread_join(workers[i].thread, NULL);
+	for (i = 0; i <= n; i++) {
+		free(workers[i].buf);
+		free(workers[i].arena);
+	}
+	free(workers);
+	workers = NULL;
+	fuse_session_reset(se);
+	return ret;
+}
+
+static void ll_set_context(fuse_req_t req)
+{
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+
+	lxcfs_ctx.uid = ctx->uid;
+	lxcfs_ctx.gid = ctx->gid;
+	lxcfs_ctx.pid = ctx->pid;
+	lxcfs_ctx.umask = ctx->umask;
+	lxcfs_ctx.private_data = fuse_req_userdata(req);
+}
+
+/* call into lxcfs_ops, with the op probes around it */
+#define ll_call(op, path, call) ({					\
+		int __ret;						\
+		LXCFS_PROBE3(op__entry, op, path, lxcfs_ctx.pid);	\
+		__ret = (call);						\
+		LXCFS_PROBE4(op__return, op, path, lxcfs_ctx.pid, __ret); \
+		__ret;							\
+	})
+
+/*
+ * How long the kernel may keep our answer for path.  Only the /cgroup
+ * tree, where lookups are expensive and cg_getattr answers the same for
+ * every caller, is cached.
+ */
+static double ll_timeout(const char *path)
+{
+	if (strncmp(path, "/cgroup", 7) != 0)
+		return 0.0;
+	return LXCFS_DATA->cg_timeout;
+}
+
+static void ll_reply_entry(fuse_req_t req, const char *path)
+{
+	struct fuse_entry_param e;
+	int ret;
+
+	memset(&e, 0, sizeof(e));
+	ret = ll_call("getattr", path, lxcfs_ops.getattr(path, &e.attr));
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	e.ino = node_lookup(path, &e.attr);
+	e.attr.st_ino = e.ino;
+	e.attr_timeout = e.entry_timeout = ll_timeout(path);
+	if (fuse_reply_entry(req, &e) != 0)
+		node_forget(e.ino, 1);
+}
+
+static void ll_reply_attr(fuse_req_t req, fuse_ino_t ino, const char *path)
+{
+	struct stat sb;
+	int ret;
+
+	memset(&sb, 0, sizeof(sb));
+	ret = ll_call("getattr", path, lxcfs_ops.getattr(path, &sb));
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	sb.st_ino = ino;
+	fuse_reply_attr(req, &sb, ll_timeout(path));
+}
+
+static void lxcfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	nih_local char *path = NULL;
+
+	ll_set_context(req);
+	if (!(path = node_child_path(parent, name))) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	ll_reply_entry(req, path);
+}
+
+static void lxcfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	node_forget(ino, nlookup);
+	fuse_reply_none(req);
+}
+
+static void lxcfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	nih_local char *path = NULL;
+
+	ll_set_context(req);
+	if (!(path = node_path(ino))) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	ll_reply_attr(req, ino, path);
+}
+
+static void lxcfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+		int to_set, struct fuse_file_info *fi)
+{
+	nih_local char *path = NULL;
+	int ret = 0;
+
+	ll_set_context(req);
+	if (!(path = node_path(ino))) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if (to_set & FUSE_SET_ATTR_MODE)
+		ret = ll_call("chmod", path, lxcfs_ops.chmod(path, attr->st_mode));
+	if (!ret && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)))
+		ret = ll_call("chown", path, lxcfs_ops.chown(path,
+			(to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1,
+			(to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1));
+	if (!ret && (to_set & FUSE_SET_ATTR_SIZE))
+		ret = ll_call("truncate", path, lxcfs_ops.truncate(path, attr->st_size));
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		ll_reply_attr(req, ino, path);
+	ll_send_invalidations();
+}
+
+static void lxcfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	nih_local char *path = NULL;
+	int ret;
+
+	ll_set_context(req);
+	if (!(path = node_child_path(parent, name))) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	ret = ll_call("mkdir", path, lxcfs_ops.mkdir(path, mode));
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	ll_reply_entry(req, path);
+	ll_send_invalidations();
+}
+
+static void lxcfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	nih_local char *path = NULL;
+
+	ll_set_context(req);
+	if (!(path = node_child_path(parent, name))) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	fuse_reply_err(req, -ll_call("rmdir", path, lxcfs_ops.rmdir(path)));
+	ll_send_invalidations();
+}
+
+static void lxcfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	nih_local char *path = NULL;
+	int ret;
+
+	ll_set_context(req);
+	if (!(path = node_path(ino))) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	ret = ll_call("open", path, lxcfs_ops.open(path, fi));
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else if (fuse_reply_open(req, fi) != 0 && fi->fh)
+		/* the open was interrupted, nobody will release it */
+		handle_free(fi->fh);
+}
+
+static void lxcfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+		off_t off, struct fuse_file_info *fi)
+{
+	nih_local char *path = NULL;
+	char *buf;
+	int ret;
+
+	ll_set_context(req);
+	if (!(path = node_path(ino))) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if (!(buf = worker_arena(size))) {
+		fuse_reply_err(req, ENOMEM);
+		return;
 	}
-	if (strncmp(path, "/proc", 5) == 0) {
-		return proc_getattr(path, sb);
+	ret = ll_call("read", path, lxcfs_ops.read(path, buf, size, off, fi));
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, buf, ret);
+}
+
+static void lxcfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+		size_t size, off_t off, struct fuse_file_info *fi)
+{
+	nih_local char *path = NULL;
+	nih_local char *data = NULL;
+	int ret;
+
+	ll_set_context(req);
+	if (!(path = node_path(ino))) {
+		fuse_reply_err(req, ENOENT);
+		return;
 	}
-	return -EINVAL;
+	/* the cgroup write code expects a string */
+	data = NIH_MUST( nih_strndup(NULL, buf, size) );
+	ret = ll_call("write", path, lxcfs_ops.write(path, data, size, off, fi));
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
 }
 
-static int lxcfs_opendir(const char *path, struct fuse_file_info *fi)
+static void lxcfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	if (strcmp(path, "/") == 0)
-		return 0;
+	nih_local char *path = NULL;
 
-	if (strncmp(path, "/cgroup", 7) == 0) {
-		return cg_opendir(path, fi);
+	ll_set_context(req);
+	if (!(path = node_path(ino))) {
+		fuse_reply_err(req, ENOENT);
+		return;
 	}
-	if (strcmp(path, "/proc") == 0)
-		return 0;
-	return -ENOENT;
+	fuse_reply_err(req, -ll_call("flush", path, lxcfs_ops.flush(path, fi)));
 }
 
-static int lxcfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
-		struct fuse_file_info *fi)
+static void lxcfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	if (strcmp(path, "/") == 0) {
-		if (filler(buf, "proc", NULL, 0) != 0 ||
-				filler(buf, "cgroup", NULL, 0) != 0)
-			return -EINVAL;
-		return 0;
+	nih_local char *path = NULL;
+
+	ll_set_context(req);
+	if (!(path = node_path(ino))) {
+		fuse_reply_err(req, ENOENT);
+		return;
 	}
-	if (strncmp(path, "/cgroup", 7) == 0)
-		return cg_readdir(path, buf, filler, offset, fi);
-	if (strcmp(path, "/proc") == 0)
-		return proc_readdir(path, buf, filler, offset, fi);
-	return -EINVAL;
+	fuse_reply_err(req, -ll_call("release", path, lxcfs_ops.release(path, fi)));
 }
 
-static int lxcfs_releasedir(const char *path, struct fuse_file_info *fi)
+static void lxcfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+		struct fuse_file_info *fi)
 {
-	if (strcmp(path, "/") == 0)
-		return 0;
-	if (strncmp(path, "/cgroup", 7) == 0) {
-		return cg_releasedir(path, fi);
+	nih_local char *path = NULL;
+
+	ll_set_context(req);
+	if (!(path = node_path(ino))) {
+		fuse_reply_err(req, ENOENT);
+		return;
 	}
-	if (strcmp(path, "/proc") == 0)
-		return 0;
-	return -EINVAL;
+	fuse_reply_err(req, -ll_call("fsync", path, lxcfs_ops.fsync(path, datasync, fi)));
 }
 
-static int lxcfs_open(const char *path, struct fuse_file_info *fi)
+/*
+ * The whole directory listing is built on the first readdir, kept in
+ * a handle, and handed out piecewise from there.
+ */
+struct lxcfs_dirbuf {
+	fuse_req_t req;
+	struct lxcfs_handle *h;
+};
+
+static int ll_dir_filler(void *buf, const char *name, const struct stat *stbuf, off_t off)
 {
-	if (strncmp(path, "/cgroup", 7) == 0)
-		return cg_open(path, fi);
-	if (strncmp(path, "/proc", 5) == 0)
-		return proc_open(path, fi);
+	struct lxcfs_dirbuf *b = buf;
+	struct lxcfs_handle *h = b->h;
+	struct stat sb;
+	size_t oldsize = h->size, size;
+	char *p;
 
-	return -EINVAL;
+	memset(&sb, 0, sizeof(sb));
+	sb.st_ino = 0xffffffff;	/* unknown until looked up */
+	size = oldsize + fuse_add_direntry(b->req, NULL, 0, name, NULL, 0);
+	p = nih_realloc(h->buf, h, size);
+	if (!p)
+		return 1;
+	h->buf = p;
+	h->size = size;
+	fuse_add_direntry(b->req, h->buf + oldsize, size - oldsize, name, &sb, size);
+	return 0;
 }
 
-static int lxcfs_read(const char *path, char *buf, size_t size, off_t offset,
-		struct fuse_file_info *fi)
+static void lxcfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	if (strncmp(path, "/cgroup", 7) == 0)
-		return cg_read(path, buf, size, offset, fi);
-	if (strncmp(path, "/proc", 5) == 0)
-		return proc_read(path, buf, size, offset, fi);
+	nih_local char *path = NULL;
+	struct lxcfs_handle *h;
+	int ret;
 
-	return -EINVAL;
+	ll_set_context(req);
+	if (!(path = node_path(ino))) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	ret = ll_call("opendir", path, lxcfs_ops.opendir(path, fi));
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	h = handle_new();
+	fi->fh = h->fh;
+	if (fuse_reply_open(req, fi) != 0)
+		handle_free(h->fh);
 }
 
-int lxcfs_write(const char *path, const char *buf, size_t size, off_t offset,
-	     struct fuse_file_info *fi)
+static void lxcfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+		off_t off, struct fuse_file_info *fi)
 {
-	if (strncmp(path, "/cgroup", 7) == 0) {
-		return cg_write(path, buf, size, offset, fi);
+	struct lxcfs_handle *h = handle_get(fi->fh);
+
+	ll_set_context(req);
+	if (!h) {
+		fuse_reply_err(req, EBADF);
+		return;
 	}
+	if (!h->filled) {
+		nih_local char *path = NULL;
+		struct lxcfs_dirbuf b = { req, h };
+		int ret;
 
-	return -EINVAL;
+		if (!(path = node_path(ino))) {
+			fuse_reply_err(req, ENOENT);
+			return;
+		}
+		ret = ll_call("readdir", path, lxcfs_ops.readdir(path, &b, ll_dir_filler, 0, fi));
+		if (ret < 0) {
+			if (h->buf)
+				nih_free(h->buf);
+			h->buf = NULL;
+			h->size = 0;
+			fuse_reply_err(req, -ret);
+			return;
+		}
+		h->filled = true;
+	}
+	if (off >= h->size)
+		fuse_reply_buf(req, NULL, 0);
+	else
+		fuse_reply_buf(req, h->buf + off, MIN(h->size - off, size));
 }
 
-static int lxcfs_flush(const char *path, struct fuse_file_info *fi)
+static void lxcfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	return 0;
+	handle_free(fi->fh);
+	fuse_reply_err(req, 0);
 }
 
-static int lxcfs_release(const char *path, struct fuse_file_info *fi)
+static const struct fuse_lowlevel_ops lxcfs_ll_ops = {
+	.lookup = lxcfs_ll_lookup,
+	.forget = lxcfs_ll_forget,
+	.getattr = lxcfs_ll_getattr,
+	.setattr = lxcfs_ll_setattr,
+	.mkdir = lxcfs_ll_mkdir,
+	.rmdir = lxcfs_ll_rmdir,
+	.open = lxcfs_ll_open,
+	.read = lxcfs_ll_read,
+	.write = lxcfs_ll_write,
+	.flush = lxcfs_ll_flush,
+	.release = lxcfs_ll_release,
+	.fsync = lxcfs_ll_fsync,
+	.opendir = lxcfs_ll_opendir,
+	.readdir = lxcfs_ll_readdir,
+	.releasedir = lxcfs_ll_releasedir,
+};
+
+/* lxcfs-bench includes this file, and brings its own main() */
+#ifndef LXCFS_BENCH
+static void usage(const char *me)
 {
-	return 0;
+	fprintf(stderr, "Usage:\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "%s [FUSE and mount options] mountpoint\n", me);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "lxcfs options:\n");
+	fprintf(stderr, "  -o cgroup_timeout=SECS  let the kernel cache lookups under /cgroup\n");
+	fprintf(stderr, "                          for SECS seconds (default: 1)\n");
+	fprintf(stderr, "  -o threads=N            serve requests with N threads (default: one\n");
+	fprintf(stderr, "                          per cpu).  -s serves them from one thread.\n");
+	fprintf(stderr, "  -o refresh=SECS         keep the /proc files read lately rendered in\n");
+	fprintf(stderr, "                          the background, every SECS seconds\n");
+	fprintf(stderr, "  -o export=PATH          publish the numbers behind those in a file\n");
+	fprintf(stderr, "                          to be mapped by host agents (implies\n");
+	fprintf(stderr, "                          refresh=1 unless set)\n");
+	fprintf(stderr, "  -o cpu_quota            show only as many cpus as the cpu cgroup's\n");
+	fprintf(stderr, "                          CFS quota is worth, within the cpuset\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Send lxcfs SIGUSR2 to have it replaced by the lxcfs binary now at the\n");
+	fprintf(stderr, "path it was started from, without unmounting.\n");
+	exit(1);
 }
 
-static int lxcfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+static const struct fuse_opt lxcfs_opts[] = {
+	{ "cgroup_timeout=%lf", offsetof(struct lxcfs_state, cg_timeout), 0 },
+	{ "threads=%u", offsetof(struct lxcfs_state, threads), 0 },
+	{ "refresh=%lf", offsetof(struct lxcfs_state, refresh), 0 },
+	{ "export=%s", offsetof(struct lxcfs_state, export_path), 0 },
+	{ "cpu_quota", offsetof(struct lxcfs_state, cpu_quota), 1 },
+	{ "upgrade_fd=%d", offsetof(struct lxcfs_state, upgrade_fd), 0 },
+	FUSE_OPT_END
+};
+
+/*
+ * fuse_mount() takes the mount options out of the arguments before they
+ * reach the session.  When taking over a mount, we drop them ourselves.
+ */
+#define MOUNT_OPT(t) FUSE_OPT_KEY(t, FUSE_OPT_KEY_DISCARD)
+static const struct fuse_opt mount_opts[] = {
+	MOUNT_OPT("allow_other"), MOUNT_OPT("allow_root"), MOUNT_OPT("nonempty"),
+	MOUNT_OPT("default_permissions"), MOUNT_OPT("blkdev"), MOUNT_OPT("auto_unmount"),
+	MOUNT_OPT("fsname="), MOUNT_OPT("subtype="), MOUNT_OPT("blksize="),
+	MOUNT_OPT("max_read="), MOUNT_OPT("user="), MOUNT_OPT("context="),
+	MOUNT_OPT("-r"), MOUNT_OPT("ro"), MOUNT_OPT("rw"), MOUNT_OPT("suid"),
+	MOUNT_OPT("nosuid"), MOUNT_OPT("dev"), MOUNT_OPT("nodev"), MOUNT_OPT("exec"),
+	MOUNT_OPT("noexec"), MOUNT_OPT("async"), MOUNT_OPT("sync"), MOUNT_OPT("dirsync"),
+	MOUNT_OPT("atime"), MOUNT_OPT("noatime"),
+	FUSE_OPT_END
+};
+
+static bool is_help(char *w)
 {
-	return 0;
+	if (strcmp(w, "-h") == 0 ||
+			strcmp(w, "--help") == 0 ||
+			strcmp(w, "-help") == 0 ||
+			strcmp(w, "help") == 0)
+		return true;
+	return false;
 }
 
-int lxcfs_mkdir(const char *path, mode_t mode)
-{
-	if (strncmp(path, "/cgroup", 7) == 0)
-		return cg_mkdir(path, mode);
+/*
+ * Live upgrades.  On SIGUSR2, the workers finish what they are doing and
+ * stop, and we start whatever lxcfs is now installed where we were started
+ * from.  We hand it the /dev/fuse fd, the kernel's INIT request, and the
+ * inodes and handles the kernel knows about, and then exit without
+ * unmounting.  Requests which come in meanwhile wait in the kernel for the
+ * new lxcfs.  If it fails to take over, we carry on serving.
+ */
+static struct fuse_session *lxcfs_se;
+static volatile sig_atomic_t upgrade_requested;
 
-	return -EINVAL;
+static void upgrade_signal(int sig)
+{
+	upgrade_requested = 1;
+	fuse_session_exit(lxcfs_se);
 }
 
-int lxcfs_chown(const char *path, uid_t uid, gid_t gid)
+static bool node_export(int sock)
 {
-	if (strncmp(path, "/cgroup", 7) == 0)
-		return cg_chown(path, uid, gid);
+	struct upgrade_node rec;
+	struct lxcfs_node *n;
+	int i;
 
-	return -EINVAL;
+	for (i = 0; i < NODE_HASH_SIZE; i++) {
+		for (n = node_ino_hash[i]; n; n = n->ino_next) {
+			rec.ino = n->ino;
+			rec.nlookup = n->nlookup;
+			rec.isdir = n->key == NULL;
+			rec.pathlen = strlen(n->path);
+			if (!upgrade_write(sock, &rec, sizeof(rec)) ||
+					!upgrade_write(sock, n->path, rec.pathlen))
+				return false;
+		}
+	}
+	return true;
 }
 
-/*
- * cat first does a truncate before doing ops->write.  This doesn't
- * really make sense for cgroups.  So just return 0 always but do
- * nothing.
- */
-int lxcfs_truncate(const char *path, off_t newsize)
+static bool node_import(int sock, uint64_t nr)
 {
-	if (strncmp(path, "/cgroup", 7) == 0)
-		return 0;
-	return -EINVAL;
+	struct upgrade_node rec;
+	struct lxcfs_node *n;
+	uint64_t i;
+
+	for (i = 0; i < nr; i++) {
+		nih_local char *path = NULL;
+
+		if (!upgrade_read(sock, &rec, sizeof(rec)))
+			return false;
+		if (rec.pathlen >= PATH_MAX) {
+			fprintf(stderr, "Bad node in upgrade\n");
+			return false;
+		}
+		path = NIH_MUST( nih_alloc(NULL, rec.pathlen + 1) );
+		if (!upgrade_read(sock, path, rec.pathlen))
+			return false;
+		path[rec.pathlen] = '\0';
+		/* we have the root already */
+		if (rec.ino == FUSE_ROOT_ID)
+			continue;
+		n = node_insert_locked(rec.ino, path, rec.isdir);
+		n->nlookup = rec.nlookup;
+	}
+	return true;
 }
 
-int lxcfs_rmdir(const char *path)
+static bool handle_export(int sock)
 {
-	if (strncmp(path, "/cgroup", 7) == 0)
-		return cg_rmdir(path);
-	return -EINVAL;
+	struct upgrade_handle rec = { 0 };
+	struct lxcfs_handle *h;
+	int i;
+
+	for (i = 0; i < HANDLE_HASH_SIZE; i++) {
+		for (h = handle_hash[i]; h; h = h->next) {
+			rec.fh = h->fh;
+			rec.size = h->size;
+			rec.filled = h->filled;
+			if (!upgrade_write(sock, &rec, sizeof(rec)) ||
+					!upgrade_write(sock, h->buf, h->size))
+				return false;
+		}
+	}
+	return true;
 }
 
-int lxcfs_chmod(const char *path, mode_t mode)
+static bool handle_import(int sock, uint64_t nr)
 {
-	if (strncmp(path, "/cgroup", 7) == 0)
-		return cg_chmod(path, mode);
-	return -EINVAL;
+	struct upgrade_handle rec;
+	struct lxcfs_handle *h;
+	uint64_t i;
+
+	for (i = 0; i < nr; i++) {
+		if (!upgrade_read(sock, &rec, sizeof(rec)))
+			return false;
+		h = handle_insert_locked(rec.fh);
+		h->filled = rec.filled;
+		if (!rec.size)
+			continue;
+		h->buf = nih_alloc(h, rec.size);
+		if (!h->buf) {
+			fprintf(stderr, "Out of memory for handle in upgrade\n");
+			return false;
+		}
+		h->size = rec.size;
+		if (!upgrade_read(sock, h->buf, h->size))
+			return false;
+	}
+	return true;
 }
 
-const struct fuse_operations lxcfs_ops = {
-	.getattr = lxcfs_getattr,
-	.readlink = NULL,
-	.getdir = NULL,
-	.mknod = NULL,
-	.mkdir = lxcfs_mkdir,
-	.unlink = NULL,
-	.rmdir = lxcfs_rmdir,
-	.symlink = NULL,
-	.rename = NULL,
-	.link = NULL,
-	.chmod = lxcfs_chmod,
-	.chown = lxcfs_chown,
-	.truncate = lxcfs_truncate,
-	.utime = NULL,
+static uint64_t count_nodes(void)
+{
+	struct lxcfs_node *n;
+	uint64_t nr = 0;
+	int i;
 
-	.open = lxcfs_open,
-	.read = lxcfs_read,
-	.release = lxcfs_release,
-	.write = lxcfs_write,
+	for (i = 0; i < NODE_HASH_SIZE; i++) {
+		for (n = node_ino_hash[i]; n; n = n->ino_next)
+			nr++;
+	}
+	return nr;
+}
 
-	.statfs = NULL,
-	.flush = lxcfs_flush,
-	.fsync = lxcfs_fsync,
+static uint64_t count_handles(void)
+{
+	struct lxcfs_handle *h;
+	uint64_t nr = 0;
+	int i;
 
-	.setxattr = NULL,
-	.getxattr = NULL,
-	.listxattr = NULL,
-	.removexattr = NULL,
+	for (i = 0; i < HANDLE_HASH_SIZE; i++) {
+		for (h = handle_hash[i]; h; h = h->next)
+			nr++;
+	}
+	return nr;
+}
 
-	.opendir = lxcfs_opendir,
-	.readdir = lxcfs_readdir,
-	.releasedir = lxcfs_releasedir,
+/*
+ * Hand the mount over to a new lxcfs.  Called with the workers stopped.
+ * Returns true if the new lxcfs has taken over, and we must exit without
+ * unmounting.
+ */
+static bool handoff(struct fuse_chan *ch, char *argv[])
+{
+	struct upgrade_header hdr = { 0 };
+	char ack;
+	pid_t pid;
+	int sock;
+	bool ok;
+
+	if (!fuse_init_req) {
+		fprintf(stderr, "Can't upgrade before the kernel's INIT\n");
+		return false;
+	}
 
-	.fsyncdir = NULL,
-	.init = NULL,
-	.destroy = NULL,
-	.access = NULL,
-	.create = NULL,
-	.ftruncate = NULL,
-	.fgetattr = NULL,
-};
+	/* it gets the fd over the socket, not by inheriting it */
+	fcntl(fuse_chan_fd(ch), F_SETFD, FD_CLOEXEC);
+	sock = upgrade_start(argv, &pid);
+	if (sock < 0)
+		return false;
 
-static void usage(const char *me)
-{
-	fprintf(stderr, "Usage:\n");
-	fprintf(stderr, "\n");
-	fprintf(stderr, "%s [FUSE and mount options] mountpoint\n", me);
-	exit(1);
+	hdr.magic = UPGRADE_MAGIC;
+	hdr.version = UPGRADE_VERSION;
+	hdr.bufsize = fuse_chan_bufsize(ch);
+	hdr.init_len = fuse_init_len;
+	hdr.next_ino = next_ino;
+	hdr.nr_nodes = count_nodes();
+	hdr.next_fh = next_fh;
+	hdr.nr_handles = count_handles();
+
+	ok = upgrade_send_fd(sock, fuse_chan_fd(ch), &hdr, sizeof(hdr)) &&
+		upgrade_write(sock, fuse_init_req, fuse_init_len) &&
+		node_export(sock) &&
+		handle_export(sock) &&
+		upgrade_read(sock, &ack, 1);
+	close(sock);
+	if (!ok) {
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return false;
+	}
+	fprintf(stderr, "Handed over to pid %d\n", pid);
+	return true;
 }
 
-static bool is_help(char *w)
+/*
+ * Take over from the lxcfs which started us with -o upgrade_fd.  Set up se
+ * as it had its session, load its nodes and handles, and return a channel
+ * on its /dev/fuse fd, or NULL if we can't take over.
+ */
+static struct fuse_chan *takeover(int sock, struct fuse_session *se)
 {
-	if (strcmp(w, "-h") == 0 ||
-			strcmp(w, "--help") == 0 ||
-			strcmp(w, "-help") == 0 ||
-			strcmp(w, "help") == 0)
-		return true;
-	return false;
+	struct upgrade_header hdr;
+	struct fuse_chan *ch;
+	char ack = 1;
+	int fd;
+
+	fd = upgrade_recv_fd(sock, &hdr, sizeof(hdr));
+	if (fd < 0)
+		return NULL;
+	if (hdr.magic != UPGRADE_MAGIC || hdr.version != UPGRADE_VERSION ||
+			!hdr.init_len || hdr.init_len > hdr.bufsize) {
+		fprintf(stderr, "Unknown upgrade protocol\n");
+		goto err;
+	}
+
+	fuse_init_len = hdr.init_len;
+	fuse_init_req = NIH_MUST( nih_alloc(NULL, fuse_init_len) );
+	if (!upgrade_read(sock, fuse_init_req, fuse_init_len))
+		goto err;
+	if (!upgrade_replay_init(se, fuse_init_req, fuse_init_len, hdr.bufsize)) {
+		fprintf(stderr, "Failed to replay INIT\n");
+		goto err;
+	}
+	if (!node_import(sock, hdr.nr_nodes) || !handle_import(sock, hdr.nr_handles))
+		goto err;
+	next_ino = hdr.next_ino;
+	next_fh = hdr.next_fh;
+
+	if (!(ch = upgrade_chan_new(fd, hdr.bufsize)))
+		goto err;
+	if (!upgrade_write(sock, &ack, 1)) {
+		fuse_chan_destroy(ch);
+		return NULL;
+	}
+	close(sock);
+	return ch;
+
+err:
+	close(fd);
+	return NULL;
 }
 
 int main(int argc, char *argv[])
 {
-	int ret;
+	int ret = -1, multithreaded, foreground;
 	struct lxcfs_state *d;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_chan *ch = NULL;
+	struct fuse_session *se;
+	struct sigaction sa;
+	char *mountpoint = NULL;
+	bool mounted = false;
 
 	if (argc < 2 || is_help(argv[1]))
 		usage(argv[0]);
 
+	upgrade_init();
+	proc_files_init();
+	node_init();
+
 	d = malloc(sizeof(*d));
 	if (!d)
 		return -1;
+	memset(d, 0, sizeof(*d));
+	d->cg_timeout = 1.0;
+	d->threads = sysconf(_SC_NPROCESSORS_ONLN);
+	d->upgrade_fd = -1;
+
+	cgm_init();
 
 	if (!cgm_escape_cgroup())
 		fprintf(stderr, "WARNING: failed to escape to root cgroup\n");
 
 	if (!cgm_get_controllers(&d->subsystems))
 		return -1;
+	/* the workers open their own connections */
+	cgm_close();
 
-	ret = fuse_main(argc, argv, &lxcfs_ops, d);
+	if (fuse_opt_parse(&args, d, lxcfs_opts, NULL) == -1)
+		goto out;
+	/* the renderers also run outside requests, without private_data */
+	cpu_quota = d->cpu_quota;
+	if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1)
+		goto out;
+	if (!mountpoint)
+		usage(argv[0]);
+	if (d->upgrade_fd < 0) {
+		if (!(ch = fuse_mount(mountpoint, &args)))
+			goto out;
+		mounted = true;
+	} else if (fuse_opt_parse(&args, NULL, mount_opts, NULL) == -1)
+		goto out;
 
-	return ret;
+	se = fuse_lowlevel_new(&args, &lxcfs_ll_ops, sizeof(lxcfs_ll_ops), d);
+	if (!se)
+		goto out_unmount;
+	if (d->upgrade_fd >= 0) {
+		/* the mount is not ours to remove until we have taken over */
+		if (!(ch = takeover(d->upgrade_fd, se)))
+			goto out_destroy;
+		mounted = true;
+	}
+	lxcfs_chan = ch;
+	lxcfs_se = se;
+
+	if (fuse_set_signal_handlers(se) == -1)
+		goto out_destroy;
+	/* no SA_RESTART, so that the worker waiting in the main thread wakes up */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = upgrade_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR2, &sa, NULL);
+	fuse_session_add_chan(se, ch);
+	if (fuse_daemonize(foreground) == 0) {
+		if (!cgwatch_start(d->subsystems, cg_changed))
+			fprintf(stderr, "WARNING: not watching cgroups for changes\n");
+		if (d->export_path) {
+			if (d->refresh <= 0)
+				d->refresh = 1;
+			if (!export_open(d->export_path, d->refresh))
+				fprintf(stderr, "WARNING: not exporting to %s\n", d->export_path);
+		}
+		if (d->refresh > 0 && !views_start(d->refresh))
+			fprintf(stderr, "WARNING: not refreshing /proc files in the background\n");
+		if (!loadavg_start())
+			fprintf(stderr, "WARNING: not sampling load, /proc/loadavg is the host's\n");
+		if (!multithreaded || d->threads < 1)
+			d->threads = 1;
+		for (;;) {
+			ret = run_workers(se, d->threads);
+			if (!upgrade_requested)
+				break;
+			upgrade_requested = 0;
+			if (handoff(ch, argv)) {
+				mounted = false;
+				ret = 0;
+				break;
+			}
+			fprintf(stderr, "Upgrade failed, carrying on\n");
+		}
+	}
+	signal(SIGUSR2, SIG_DFL);
+	fuse_remove_signal_handlers(se);
+	fuse_session_remove_chan(ch);
+
+out_destroy:
+	fuse_session_destroy(se);
+out_unmount:
+	/* after a handoff, the fd is closed as we exit */
+	if (mounted)
+		fuse_unmount(mountpoint, ch);
+out:
+	fuse_opt_free_args(&args);
+	free(mountpoint);
+	return ret ? 1 : 0;
 }
+#endif /* LXCFS_BENCH */
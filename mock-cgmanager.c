@@ -0,0 +1,799 @@
+/* lxcfs
+ *
+ * Copyright © 2015 Canonical, Inc
+ *
+ * See COPYING file for details.
+ */
+
+/*
+ * mock-cgmanager: a stand-in for cgmanager, for testing and benchmarking
+ * lxcfs without root or real cgroups.
+ *
+ * It serves the cgmanager D-Bus interface on a private socket, over a
+ * cgroup tree which only exists in memory.  Each controller starts with
+ * just its root cgroup, holding a few files with made up values.  Point
+ * lxcfs at it with
+ *
+ *	CGMANAGER_DBUS_SOCK=unix:path=/tmp/cgm.sock lxcfs ...
+ *
+ * Calls can be made slow (-d) or fail (-e), either all of them or only
+ * those of one method, to see how lxcfs copes with a struggling cgmanager.
+ * Like cgmanager, it serves one call at a time, so a slow call holds up
+ * everyone else's.
+ *
+ * There are no permission checks: anyone may do anything.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <sys/types.h>
+
+#include <dbus/dbus.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/error.h>
+#include <nih/main.h>
+#include <nih-dbus/dbus_connection.h>
+
+#define CGM_INTERFACE "org.linuxcontainers.cgmanager0_0"
+#define CGM_PATH "/org/linuxcontainers/cgmanager"
+#define CGM_API_VERSION 9
+
+struct mock_file {
+	char *name;
+	char *value;
+	uid_t uid;
+	gid_t gid;
+	mode_t mode;
+	struct mock_file *next;
+};
+
+struct mock_cgroup {
+	char *name;
+	uid_t uid;
+	gid_t gid;
+	mode_t mode;
+	struct mock_file *files;
+	struct mock_cgroup *parent, *children, *next;
+};
+
+struct mock_controller {
+	char *name;
+	struct mock_cgroup *root;
+	struct mock_controller *next;
+};
+
+static struct mock_controller *controllers;
+
+/* the files every new cgroup gets, with their initial values */
+static const struct {
+	const char *controller;	/* NULL for all */
+	const char *name;
+	const char *value;
+} default_files[] = {
+	{ NULL, "tasks", "" },
+	{ NULL, "cgroup.procs", "" },
+	{ NULL, "notify_on_release", "0\n" },
+	{ "memory", "memory.limit_in_bytes", "9223372036854771712\n" },
+	{ "memory", "memory.usage_in_bytes", "0\n" },
+	{ "memory", "memory.memsw.limit_in_bytes", "9223372036854771712\n" },
+	{ "memory", "memory.memsw.usage_in_bytes", "0\n" },
+	{ "memory", "memory.stat", "cache 0\nrss 0\nmapped_file 0\nswap 0\n"
+		"hierarchical_memory_limit 9223372036854771712\n"
+		"hierarchical_memsw_limit 9223372036854771712\n"
+		"total_cache 0\ntotal_rss 0\ntotal_swap 0\n" },
+	{ "cpuset", "cpuset.cpus", NULL },	/* filled in at startup */
+	{ "cpuset", "cpuset.mems", "0\n" },
+	{ "cpu", "cpu.shares", "1024\n" },
+	{ "cpu", "cpu.cfs_quota_us", "-1\n" },
+	{ "cpu", "cpu.cfs_period_us", "100000\n" },
+	{ "cpuacct", "cpuacct.usage", "0\n" },
+	{ "cpuacct", "cpuacct.stat", "user 0\nsystem 0\n" },
+	{ "blkio", "blkio.throttle.io_service_bytes", "Total 0\n" },
+	{ "blkio", "blkio.throttle.io_serviced", "Total 0\n" },
+	{ "blkio", "blkio.io_serviced_recursive", "Total 0\n" },
+	{ "blkio", "blkio.io_service_bytes_recursive", "Total 0\n" },
+	{ "blkio", "blkio.io_wait_time_recursive", "Total 0\n" },
+};
+
+static char *cpuset_cpus;
+
+/*
+ * Latency and faults to inject, either for every method (method NULL)
+ * or for one.  The most specific match wins.
+ */
+struct mock_rule {
+	char *method;
+	unsigned long delay_min, delay_max;	/* usec */
+	double error_rate;
+	struct mock_rule *next;
+};
+
+static struct mock_rule *rules;
+
+static struct mock_rule *find_rule(const char *method, bool create)
+{
+	struct mock_rule *r;
+
+	for (r = rules; r; r = r->next) {
+		if ((!r->method && !method) ||
+				(r->method && method && strcmp(r->method, method) == 0))
+			return r;
+	}
+	if (!create)
+		return NULL;
+	r = NIH_MUST( nih_new(NULL, struct mock_rule) );
+	memset(r, 0, sizeof(*r));
+	r->method = method ? NIH_MUST( nih_strdup(r, method) ) : NULL;
+	r->next = rules;
+	rules = r;
+	return r;
+}
+
+static struct mock_rule *rule_for(const char *method)
+{
+	struct mock_rule *r = find_rule(method, false);
+
+	return r ? r : find_rule(NULL, false);
+}
+
+/*
+ * Tree
+ */
+
+static struct mock_cgroup *new_cgroup(struct mock_controller *c,
+		struct mock_cgroup *parent, const char *name, uid_t uid, gid_t gid)
+{
+	struct mock_cgroup *cg;
+	struct mock_file *f;
+	int i;
+
+	cg = NIH_MUST( nih_new(parent ? (void *)parent : (void *)c, struct mock_cgroup) );
+	memset(cg, 0, sizeof(*cg));
+	cg->name = NIH_MUST( nih_strdup(cg, name) );
+	cg->uid = uid;
+	cg->gid = gid;
+	cg->mode = 0755;
+	cg->parent = parent;
+	if (parent) {
+		cg->next = parent->children;
+		parent->children = cg;
+	}
+
+	for (i = 0; i < sizeof(default_files) / sizeof(default_files[0]); i++) {
+		const char *value = default_files[i].value;
+
+		if (default_files[i].controller &&
+				strcmp(default_files[i].controller, c->name) != 0)
+			continue;
+		if (!value)
+			value = cpuset_cpus;
+		f = NIH_MUST( nih_new(cg, struct mock_file) );
+		f->name = NIH_MUST( nih_strdup(f, default_files[i].name) );
+		f->value = NIH_MUST( nih_strdup(f, value) );
+		f->uid = uid;
+		f->gid = gid;
+		f->mode = 0644;
+		f->next = cg->files;
+		cg->files = f;
+	}
+	return cg;
+}
+
+static void add_controller(const char *name)
+{
+	struct mock_controller *c;
+
+	c = NIH_MUST( nih_new(NULL, struct mock_controller) );
+	c->name = NIH_MUST( nih_strdup(c, name) );
+	c->root = new_cgroup(c, NULL, "", 0, 0);
+	c->next = controllers;
+	controllers = c;
+}
+
+static struct mock_controller *find_controller(const char *name)
+{
+	struct mock_controller *c;
+
+	for (c = controllers; c; c = c->next) {
+		if (strcmp(c->name, name) == 0)
+			return c;
+	}
+	return NULL;
+}
+
+static struct mock_cgroup *find_child(struct mock_cgroup *cg, const char *name, size_t len)
+{
+	struct mock_cgroup *child;
+
+	for (child = cg->children; child; child = child->next) {
+		if (strlen(child->name) == len && strncmp(child->name, name, len) == 0)
+			return child;
+	}
+	return NULL;
+}
+
+/*
+ * Find @path, with or without its leading '/', below the root of
+ * @controller.  If @missing is not NULL, stop at the last existing cgroup
+ * and point it at what is left of the path.
+ */
+static struct mock_cgroup *find_cgroup(const char *controller, const char *path,
+		const char **missing)
+{
+	struct mock_controller *c = find_controller(controller);
+	struct mock_cgroup *cg, *child;
+	size_t len;
+
+	if (!c)
+		return NULL;
+	cg = c->root;
+	while (*path) {
+		while (*path == '/')
+			path++;
+		if (!*path)
+			break;
+		len = strcspn(path, "/");
+		if (!(child = find_child(cg, path, len))) {
+			if (!missing)
+				return NULL;
+			*missing = path;
+			return cg;
+		}
+		cg = child;
+		path += len;
+	}
+	if (missing)
+		*missing = NULL;
+	return cg;
+}
+
+static struct mock_file *find_file(struct mock_cgroup *cg, const char *name)
+{
+	struct mock_file *f;
+
+	for (f = cg->files; f; f = f->next) {
+		if (strcmp(f->name, name) == 0)
+			return f;
+	}
+	return NULL;
+}
+
+static char *cgroup_path(const void *parent, struct mock_cgroup *cg)
+{
+	char *path;
+
+	if (!cg->parent)
+		return NIH_MUST( nih_strdup(parent, "/") );
+	path = cgroup_path(parent, cg->parent);
+	if (cg->parent->parent)
+		NIH_MUST( nih_strcat(&path, parent, "/") );
+	NIH_MUST( nih_strcat(&path, parent, cg->name) );
+	return path;
+}
+
+static bool has_pid(const char *list, pid_t pid)
+{
+	const char *p;
+	char *end;
+
+	for (p = list; *p; p = end) {
+		if (strtol(p, &end, 10) == pid)
+			return true;
+		if (end == p)
+			break;
+		while (*end == '\n')
+			end++;
+	}
+	return false;
+}
+
+static void drop_pid(struct mock_file *f, pid_t pid)
+{
+	char *out = NIH_MUST( nih_strdup(f, "") );
+	const char *p;
+	char *end;
+	long v;
+
+	for (p = f->value; *p; p = end) {
+		v = strtol(p, &end, 10);
+		if (end == p)
+			break;
+		if (v != pid)
+			NIH_MUST( nih_strcat_sprintf(&out, f, "%ld\n", v) );
+		while (*end == '\n')
+			end++;
+	}
+	nih_free(f->value);
+	f->value = out;
+}
+
+static void drop_pid_below(struct mock_cgroup *cg, pid_t pid)
+{
+	struct mock_cgroup *child;
+	struct mock_file *f;
+
+	if ((f = find_file(cg, "tasks")))
+		drop_pid(f, pid);
+	if ((f = find_file(cg, "cgroup.procs")))
+		drop_pid(f, pid);
+	for (child = cg->children; child; child = child->next)
+		drop_pid_below(child, pid);
+}
+
+static struct mock_cgroup *find_pid_below(struct mock_cgroup *cg, pid_t pid)
+{
+	struct mock_cgroup *child, *found;
+	struct mock_file *f;
+
+	if ((f = find_file(cg, "tasks")) && has_pid(f->value, pid))
+		return cg;
+	for (child = cg->children; child; child = child->next) {
+		if ((found = find_pid_below(child, pid)))
+			return found;
+	}
+	return NULL;
+}
+
+static void move_pid(struct mock_controller *c, struct mock_cgroup *cg, pid_t pid)
+{
+	struct mock_file *f;
+
+	drop_pid_below(c->root, pid);
+	if ((f = find_file(cg, "tasks")))
+		NIH_MUST( nih_strcat_sprintf(&f->value, f, "%d\n", pid) );
+	if ((f = find_file(cg, "cgroup.procs")))
+		NIH_MUST( nih_strcat_sprintf(&f->value, f, "%d\n", pid) );
+}
+
+/*
+ * Methods.  Each fills in the reply, or returns an error message.
+ */
+
+#define ARGS(...) \
+	if (!dbus_message_get_args(msg, NULL, __VA_ARGS__, DBUS_TYPE_INVALID)) \
+		return "invalid arguments"
+
+static const char *m_list_controllers(DBusConnection *conn, DBusMessage *msg, DBusMessage *reply)
+{
+	struct mock_controller *c;
+	DBusMessageIter iter, sub;
+
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, DBUS_TYPE_STRING_AS_STRING, &sub);
+	for (c = controllers; c; c = c->next)
+		dbus_message_iter_append_basic(&sub, DBUS_TYPE_STRING, &c->name);
+	dbus_message_iter_close_container(&iter, &sub);
+	return NULL;
+}
+
+static const char *m_list_keys(DBusConnection *conn, DBusMessage *msg, DBusMessage *reply)
+{
+	const char *controller, *path;
+	struct mock_cgroup *cg;
+	struct mock_file *f;
+	DBusMessageIter iter, sub, st;
+	uint32_t v;
+
+	ARGS(DBUS_TYPE_STRING, &controller, DBUS_TYPE_STRING, &path);
+	if (!(cg = find_cgroup(controller, path, NULL)))
+		return "no such cgroup";
+
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(suuu)", &sub);
+	for (f = cg->files; f; f = f->next) {
+		dbus_message_iter_open_container(&sub, DBUS_TYPE_STRUCT, NULL, &st);
+		dbus_message_iter_append_basic(&st, DBUS_TYPE_STRING, &f->name);
+		v = f->uid;
+		dbus_message_iter_append_basic(&st, DBUS_TYPE_UINT32, &v);
+		v = f->gid;
+		dbus_message_iter_append_basic(&st, DBUS_TYPE_UINT32, &v);
+		v = f->mode;
+		dbus_message_iter_append_basic(&st, DBUS_TYPE_UINT32, &v);
+		dbus_message_iter_close_container(&sub, &st);
+	}
+	dbus_message_iter_close_container(&iter, &sub);
+	return NULL;
+}
+
+static const char *m_list_children(DBusConnection *conn, DBusMessage *msg, DBusMessage *reply)
+{
+	const char *controller, *path;
+	struct mock_cgroup *cg, *child;
+	DBusMessageIter iter, sub;
+
+	ARGS(DBUS_TYPE_STRING, &controller, DBUS_TYPE_STRING, &path);
+	if (!(cg = find_cgroup(controller, path, NULL)))
+		return "no such cgroup";
+
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, DBUS_TYPE_STRING_AS_STRING, &sub);
+	for (child = cg->children; child; child = child->next)
+		dbus_message_iter_append_basic(&sub, DBUS_TYPE_STRING, &child->name);
+	dbus_message_iter_close_container(&iter, &sub);
+	return NULL;
+}
+
+static const char *m_get_value(DBusConnection *conn, DBusMessage *msg, DBusMessage *reply)
+{
+	const char *controller, *path, *key;
+	struct mock_cgroup *cg;
+	struct mock_file *f;
+
+	ARGS(DBUS_TYPE_STRING, &controller, DBUS_TYPE_STRING, &path, DBUS_TYPE_STRING, &key);
+	if (!(cg = find_cgroup(controller, path, NULL)))
+		return "no such cgroup";
+	if (!(f = find_file(cg, key)))
+		return "no such file";
+	dbus_message_append_args(reply, DBUS_TYPE_STRING, &f->value, DBUS_TYPE_INVALID);
+	return NULL;
+}
+
+static const char *m_set_value(DBusConnection *conn, DBusMessage *msg, DBusMessage *reply)
+{
+	const char *controller, *path, *key, *value;
+	struct mock_cgroup *cg;
+	struct mock_file *f;
+
+	ARGS(DBUS_TYPE_STRING, &controller, DBUS_TYPE_STRING, &path,
+		DBUS_TYPE_STRING, &key, DBUS_TYPE_STRING, &value);
+	if (!(cg = find_cgroup(controller, path, NULL)))
+		return "no such cgroup";
+	if (!(f = find_file(cg, key)))
+		return "no such file";
+	if (strcmp(key, "tasks") == 0 || strcmp(key, "cgroup.procs") == 0) {
+		move_pid(find_controller(controller), cg, atoi(value));
+		return NULL;
+	}
+	nih_free(f->value);
+	f->value = NIH_MUST( nih_sprintf(f, "%s%s", value,
+			*value && value[strlen(value)-1] == '\n' ? "" : "\n") );
+	return NULL;
+}
+
+/* paths are always from the root here, so MovePidAbs is the same thing */
+static const char *m_move_pid(DBusConnection *conn, DBusMessage *msg, DBusMessage *reply)
+{
+	const char *controller, *path;
+	struct mock_controller *c;
+	struct mock_cgroup *cg;
+	int32_t pid;
+
+	ARGS(DBUS_TYPE_STRING, &controller, DBUS_TYPE_STRING, &path, DBUS_TYPE_INT32, &pid);
+	if (strcmp(controller, "all") == 0) {
+		for (c = controllers; c; c = c->next) {
+			if ((cg = find_cgroup(c->name, path, NULL)))
+				move_pid(c, cg, pid);
+		}
+		return NULL;
+	}
+	if (!(cg = find_cgroup(controller, path, NULL)))
+		return "no such cgroup";
+	move_pid(find_controller(controller), cg, pid);
+	return NULL;
+}
+
+static const char *m_get_pid_cgroup(DBusConnection *conn, DBusMessage *msg, DBusMessage *reply)
+{
+	nih_local char *path = NULL;
+	const char *controller;
+	struct mock_controller *c;
+	struct mock_cgroup *cg;
+	int32_t pid;
+
+	ARGS(DBUS_TYPE_STRING, &controller, DBUS_TYPE_INT32, &pid);
+	if (!(c = find_controller(controller)))
+		return "no such controller";
+	if (!(cg = find_pid_below(c->root, pid)))
+		cg = c->root;
+	path = cgroup_path(NULL, cg);
+	dbus_message_append_args(reply, DBUS_TYPE_STRING, &path, DBUS_TYPE_INVALID);
+	return NULL;
+}
+
+/* new cgroups belong to whoever created them, as with cgmanager */
+static void caller_ids(DBusConnection *conn, uid_t *uid, gid_t *gid)
+{
+	unsigned long u = 0;
+	struct passwd *pw;
+
+	dbus_connection_get_unix_user(conn, &u);
+	*uid = u;
+	*gid = (pw = getpwuid(u)) ? pw->pw_gid : u;
+}
+
+static const char *m_create(DBusConnection *conn, DBusMessage *msg, DBusMessage *reply)
+{
+	const char *controller, *path, *missing;
+	struct mock_cgroup *cg;
+	int32_t existed = 1;
+	uid_t uid;
+	gid_t gid;
+	size_t len;
+
+	ARGS(DBUS_TYPE_STRING, &controller, DBUS_TYPE_STRING, &path);
+	if (!(cg = find_cgroup(controller, path, &missing)))
+		return "no such controller";
+	caller_ids(conn, &uid, &gid);
+	while (missing && *missing) {
+		nih_local char *name = NULL;
+
+		len = strcspn(missing, "/");
+		name = NIH_MUST( nih_strndup(NULL, missing, len) );
+		cg = new_cgroup(find_controller(controller), cg, name, uid, gid);
+		existed = 0;
+		missing += len;
+		while (*missing == '/')
+			missing++;
+	}
+	dbus_message_append_args(reply, DBUS_TYPE_INT32, &existed, DBUS_TYPE_INVALID);
+	return NULL;
+}
+
+static const char *m_remove(DBusConnection *conn, DBusMessage *msg, DBusMessage *reply)
+{
+	const char *controller, *path;
+	struct mock_cgroup *cg, **cgp;
+	int32_t recursive, existed = 0;
+
+	ARGS(DBUS_TYPE_STRING, &controller, DBUS_TYPE_STRING, &path,
+		DBUS_TYPE_INT32, &recursive);
+	if ((cg = find_cgroup(controller, path, NULL))) {
+		if (!cg->parent)
+			return "cannot remove the root cgroup";
+		if (cg->children && !recursive)
+			return "cgroup has children";
+		if (*find_file(cg, "tasks")->value)
+			return "cgroup is busy";
+		for (cgp = &cg->parent->children; *cgp != cg; cgp = &(*cgp)->next)
+			;
+		*cgp = cg->next;
+		nih_free(cg);
+		existed = 1;
+	}
+	dbus_message_append_args(reply, DBUS_TYPE_INT32, &existed, DBUS_TYPE_INVALID);
+	return NULL;
+}
+
+static const char *m_chown(DBusConnection *conn, DBusMessage *msg, DBusMessage *reply)
+{
+	const char *controller, *path;
+	struct mock_cgroup *cg;
+	struct mock_file *f;
+	int32_t uid, gid;
+
+	ARGS(DBUS_TYPE_STRING, &controller, DBUS_TYPE_STRING, &path,
+		DBUS_TYPE_INT32, &uid, DBUS_TYPE_INT32, &gid);
+	if (!(cg = find_cgroup(controller, path, NULL)))
+		return "no such cgroup";
+	/* like cgmanager, chown the directory and the files to move tasks */
+	cg->uid = uid;
+	cg->gid = gid;
+	for (f = cg->files; f; f = f->next) {
+		if (strcmp(f->name, "tasks") == 0 || strcmp(f->name, "cgroup.procs") == 0) {
+			f->uid = uid;
+			f->gid = gid;
+		}
+	}
+	return NULL;
+}
+
+static const char *m_chmod(DBusConnection *conn, DBusMessage *msg, DBusMessage *reply)
+{
+	const char *controller, *path, *file;
+	struct mock_cgroup *cg;
+	struct mock_file *f;
+	int32_t mode;
+
+	ARGS(DBUS_TYPE_STRING, &controller, DBUS_TYPE_STRING, &path,
+		DBUS_TYPE_STRING, &file, DBUS_TYPE_INT32, &mode);
+	if (!(cg = find_cgroup(controller, path, NULL)))
+		return "no such cgroup";
+	if (!*file) {
+		cg->mode = mode;
+		return NULL;
+	}
+	if (!(f = find_file(cg, file)))
+		return "no such file";
+	f->mode = mode;
+	return NULL;
+}
+
+static const struct {
+	const char *name;
+	const char *(*fn)(DBusConnection *conn, DBusMessage *msg, DBusMessage *reply);
+} methods[] = {
+	{ "ListControllers", m_list_controllers },
+	{ "ListKeys", m_list_keys },
+	{ "ListChildren", m_list_children },
+	{ "GetValue", m_get_value },
+	{ "SetValue", m_set_value },
+	{ "MovePid", m_move_pid },
+	{ "MovePidAbs", m_move_pid },
+	{ "GetPidCgroup", m_get_pid_cgroup },
+	{ "Create", m_create },
+	{ "Remove", m_remove },
+	{ "Chown", m_chown },
+	{ "Chmod", m_chmod },
+	{ NULL, NULL },
+};
+
+/* Properties.Get, for the api_version which clients ask for first */
+static const char *get_property(DBusMessage *msg, DBusMessage *reply)
+{
+	const char *iface, *prop;
+	DBusMessageIter iter, sub;
+	int32_t version = CGM_API_VERSION;
+
+	ARGS(DBUS_TYPE_STRING, &iface, DBUS_TYPE_STRING, &prop);
+	if (strcmp(prop, "api_version") != 0)
+		return "no such property";
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_VARIANT, DBUS_TYPE_INT32_AS_STRING, &sub);
+	dbus_message_iter_append_basic(&sub, DBUS_TYPE_INT32, &version);
+	dbus_message_iter_close_container(&iter, &sub);
+	return NULL;
+}
+
+static DBusHandlerResult handle_message(DBusConnection *conn, DBusMessage *msg, void *data)
+{
+	const char *member = dbus_message_get_member(msg);
+	const char *iface = dbus_message_get_interface(msg);
+	const char *path = dbus_message_get_path(msg);
+	const char *err = NULL;
+	struct mock_rule *rule;
+	DBusMessage *reply;
+	int i;
+
+	if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_METHOD_CALL || !member)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	if (!path || strcmp(path, CGM_PATH) != 0)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	if ((rule = rule_for(member))) {
+		if (rule->delay_max)
+			usleep(rule->delay_min + random() % (rule->delay_max - rule->delay_min + 1));
+		if (rule->error_rate > 0 && random() < rule->error_rate * RAND_MAX)
+			err = "injected fault";
+	}
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+	if (err)
+		;
+	else if (iface && strcmp(iface, DBUS_INTERFACE_PROPERTIES) == 0 &&
+			strcmp(member, "Get") == 0)
+		err = get_property(msg, reply);
+	else if (iface && strcmp(iface, CGM_INTERFACE) != 0)
+		err = "unknown interface";
+	else {
+		for (i = 0; methods[i].name; i++) {
+			if (strcmp(methods[i].name, member) == 0)
+				break;
+		}
+		if (methods[i].name)
+			err = methods[i].fn(conn, msg, reply);
+		else
+			err = "unknown method";
+	}
+
+	if (err) {
+		dbus_message_unref(reply);
+		reply = dbus_message_new_error(msg, DBUS_ERROR_FAILED, err);
+		if (!reply)
+			return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+	dbus_connection_send(conn, reply, NULL);
+	dbus_message_unref(reply);
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static dbus_bool_t allow_user(DBusConnection *conn, unsigned long uid, void *data)
+{
+	return TRUE;
+}
+
+static int client_connect(DBusServer *server, DBusConnection *conn)
+{
+	dbus_connection_set_unix_user_function(conn, allow_user, NULL, NULL);
+	dbus_connection_set_allow_anonymous(conn, TRUE);
+	if (!dbus_connection_add_filter(conn, handle_message, NULL, NULL))
+		return FALSE;
+	return TRUE;
+}
+
+static void client_disconnect(DBusConnection *conn)
+{
+}
+
+/*
+ * Parse "[Method=]MIN[-MAX]" for -d, and "[Method=]RATE" for -e.
+ */
+static struct mock_rule *parse_rule(char *arg, char **rest)
+{
+	char *eq = strchr(arg, '=');
+
+	if (!eq) {
+		*rest = arg;
+		return find_rule(NULL, true);
+	}
+	*eq = '\0';
+	*rest = eq + 1;
+	return find_rule(arg, true);
+}
+
+static void usage(const char *me)
+{
+	fprintf(stderr, "Usage: %s [-a address] [-c controller,...] [-d [Method=]usec[-usec]]\n", me);
+	fprintf(stderr, "       [-e [Method=]rate]\n\n");
+	fprintf(stderr, "  -a   D-Bus address to listen on (default unix:path=/tmp/mock-cgmanager.sock)\n");
+	fprintf(stderr, "  -c   controllers to serve (default memory,cpuset,cpu,cpuacct,blkio,devices,freezer)\n");
+	fprintf(stderr, "  -d   delay each call, or each call of one method, by a random time in the range\n");
+	fprintf(stderr, "  -e   fail this fraction of calls\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *address = "unix:path=/tmp/mock-cgmanager.sock";
+	char *ctrls = "memory,cpuset,cpu,cpuacct,blkio,devices,freezer";
+	struct mock_rule *r;
+	DBusServer *server;
+	char *tok, *rest, *end;
+	long ncpus;
+	int c;
+
+	while ((c = getopt(argc, argv, "a:c:d:e:h")) != -1) {
+		switch (c) {
+		case 'a':
+			address = optarg;
+			break;
+		case 'c':
+			ctrls = optarg;
+			break;
+		case 'd':
+			r = parse_rule(optarg, &rest);
+			r->delay_min = r->delay_max = strtoul(rest, &end, 10);
+			if (*end == '-')
+				r->delay_max = strtoul(end + 1, &end, 10);
+			if (*end || r->delay_max < r->delay_min)
+				usage(argv[0]);
+			break;
+		case 'e':
+			r = parse_rule(optarg, &rest);
+			r->error_rate = strtod(rest, &end);
+			if (*end || r->error_rate < 0 || r->error_rate > 1)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	cpuset_cpus = ncpus > 1 ?
+		NIH_MUST( nih_sprintf(NULL, "0-%ld\n", ncpus - 1) ) :
+		NIH_MUST( nih_strdup(NULL, "0\n") );
+	for (tok = strtok(ctrls, ","); tok; tok = strtok(NULL, ","))
+		add_controller(tok);
+
+	nih_main_init(argv[0]);
+	server = nih_dbus_server(address, client_connect, client_disconnect);
+	if (!server) {
+		NihError *nerr = nih_error_get();
+		fprintf(stderr, "Failed to listen on %s: %s\n", address, nerr->message);
+		nih_free(nerr);
+		return 1;
+	}
+
+	return nih_main_loop();
+}
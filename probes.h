@@ -0,0 +1,26 @@
+/*
+ * USDT probes, for bpftrace, systemtap and friends:
+ *
+ *   op__entry(op, path, pid), op__return(op, path, pid, ret)
+ *	around each filesystem op, made on behalf of caller pid
+ *   cgm__entry(call, cgroup), cgm__return(call, cgroup, ret)
+ *	around each call to cgmanager
+ *   helper__fork(helper, tpid, cpid), helper__exit(helper, cpid, ret)
+ *	around each helper process forked to act in the pid namespace
+ *	of tpid
+ *
+ * A probe which nobody is tracing is a nop.  Without sys/sdt.h they
+ * compile to nothing at all.  Their arguments should be cheap and free
+ * of side effects.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define LXCFS_PROBE2(name, a, b) DTRACE_PROBE2(lxcfs, name, a, b)
+#define LXCFS_PROBE3(name, a, b, c) DTRACE_PROBE3(lxcfs, name, a, b, c)
+#define LXCFS_PROBE4(name, a, b, c, d) DTRACE_PROBE4(lxcfs, name, a, b, c, d)
+#else
+#define LXCFS_PROBE2(name, a, b) do { (void) (a); (void) (b); } while (0)
+#define LXCFS_PROBE3(name, a, b, c) do { (void) (a); (void) (b); (void) (c); } while (0)
+#define LXCFS_PROBE4(name, a, b, c, d) do { (void) (a); (void) (b); (void) (c); (void) (d); } while (0)
+#endif
@@ -0,0 +1,232 @@
+/* lxcfs
+ *
+ * Copyright © 2015 Canonical, Inc
+ *
+ * See COPYING file for details.
+ */
+
+/*
+ * Counters and latency histograms about lxcfs itself.
+ *
+ * Everything here is updated from all worker threads at once, with atomic
+ * adds and no locks.  A reader may therefore see a histogram whose sum
+ * doesn't quite match its buckets, which is fine for monitoring.
+ *
+ * Latencies go into power of two buckets of microseconds, from 1us up to
+ * about 4s, and are rendered in the Prometheus text format.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/macros.h>
+
+#include "stats.h"
+
+#define STATS_BUCKETS 24	/* the last one is +Inf */
+
+struct stats_hist {
+	uint64_t buckets[STATS_BUCKETS];
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t errors;
+};
+
+static struct stats_hist op_hist[STATS_NR_OPS][STATS_NR_AREAS];
+static struct stats_hist cgm_hist[STATS_NR_CGM];
+static uint64_t counters[STATS_NR_COUNTERS];
+
+static const char *op_names[STATS_NR_OPS] = {
+	[STATS_GETATTR] = "getattr",
+	[STATS_READDIR] = "readdir",
+	[STATS_READ] = "read",
+	[STATS_WRITE] = "write",
+};
+
+static const char *area_names[STATS_NR_AREAS] = {
+	[STATS_PROC] = "proc",
+	[STATS_CGROUP] = "cgroup",
+	[STATS_SYS] = "sys",
+};
+
+static const char *cgm_names[STATS_NR_CGM] = {
+	[STATS_CGM_GET_CONTROLLERS] = "get_controllers",
+	[STATS_CGM_LIST_KEYS] = "list_keys",
+	[STATS_CGM_LIST_CHILDREN] = "list_children",
+	[STATS_CGM_GET_PID_CGROUP] = "get_pid_cgroup",
+	[STATS_CGM_ESCAPE_CGROUP] = "escape_cgroup",
+	[STATS_CGM_MOVE_PID] = "move_pid",
+	[STATS_CGM_GET_VALUE] = "get_value",
+	[STATS_CGM_SET_VALUE] = "set_value",
+	[STATS_CGM_CREATE] = "create",
+	[STATS_CGM_CHOWN_FILE] = "chown_file",
+	[STATS_CGM_CHMOD_FILE] = "chmod_file",
+	[STATS_CGM_REMOVE] = "remove",
+	[STATS_CGM_BATCH] = "batch",
+};
+
+const char *stats_cgm_name(enum stats_cgm call)
+{
+	return cgm_names[call];
+}
+
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* index of the smallest bucket whose upper bound, 2^i us, is >= @us */
+static int bucket(uint64_t us)
+{
+	int i;
+
+	if (us <= 1)
+		return 0;
+	i = 64 - __builtin_clzll(us - 1);
+	return i < STATS_BUCKETS - 1 ? i : STATS_BUCKETS - 1;
+}
+
+static void hist_add(struct stats_hist *h, uint64_t start, bool ok)
+{
+	uint64_t ns = stats_now() - start;
+
+	__sync_fetch_and_add(&h->buckets[bucket(ns / 1000)], 1);
+	__sync_fetch_and_add(&h->sum_ns, ns);
+	__sync_fetch_and_add(&h->count, 1);
+	if (!ok)
+		__sync_fetch_and_add(&h->errors, 1);
+}
+
+void stats_op(enum stats_op op, enum stats_area area, uint64_t start, int ret)
+{
+	hist_add(&op_hist[op][area], start, ret >= 0);
+}
+
+void stats_cgm(enum stats_cgm call, uint64_t start, bool ok)
+{
+	hist_add(&cgm_hist[call], start, ok);
+}
+
+void stats_inc(enum stats_counter c)
+{
+	__sync_fetch_and_add(&counters[c], 1);
+}
+
+static uint64_t get(uint64_t *v)
+{
+	return __sync_fetch_and_add(v, 0);
+}
+
+static void render_hist(char **out, const void *parent, const char *name,
+		const char *labels, struct stats_hist *h)
+{
+	uint64_t cum = 0;
+	int i;
+
+	for (i = 0; i < STATS_BUCKETS - 1; i++) {
+		cum += get(&h->buckets[i]);
+		NIH_MUST( nih_strcat_sprintf(out, parent, "%s_bucket{%s,le=\"%g\"} %llu\n",
+				name, labels, (double) (1ULL << i) / 1e6,
+				(unsigned long long) cum) );
+	}
+	cum += get(&h->buckets[i]);
+	NIH_MUST( nih_strcat_sprintf(out, parent, "%s_bucket{%s,le=\"+Inf\"} %llu\n",
+			name, labels, (unsigned long long) cum) );
+	NIH_MUST( nih_strcat_sprintf(out, parent, "%s_sum{%s} %.9f\n",
+			name, labels, get(&h->sum_ns) / 1e9) );
+	NIH_MUST( nih_strcat_sprintf(out, parent, "%s_count{%s} %llu\n",
+			name, labels, (unsigned long long) cum) );
+}
+
+/*
+ * Render everything in the Prometheus text format, into a string
+ * allocated under @parent.
+ */
+char *stats_render(const void *parent)
+{
+	char *out = NIH_MUST( nih_strdup(parent, "") );
+	char labels[100];
+	int i, j;
+
+	NIH_MUST( nih_strcat(&out, parent,
+		"# HELP lxcfs_op_duration_seconds Time taken to serve filesystem operations.\n"
+		"# TYPE lxcfs_op_duration_seconds histogram\n") );
+	for (i = 0; i < STATS_NR_OPS; i++) {
+		for (j = 0; j < STATS_NR_AREAS; j++) {
+			snprintf(labels, sizeof(labels), "op=\"%s\",fs=\"%s\"",
+				op_names[i], area_names[j]);
+			render_hist(&out, parent, "lxcfs_op_duration_seconds", labels,
+				&op_hist[i][j]);
+		}
+	}
+
+	NIH_MUST( nih_strcat(&out, parent,
+		"# HELP lxcfs_op_errors_total Filesystem operations which returned an error.\n"
+		"# TYPE lxcfs_op_errors_total counter\n") );
+	for (i = 0; i < STATS_NR_OPS; i++) {
+		for (j = 0; j < STATS_NR_AREAS; j++) {
+			NIH_MUST( nih_strcat_sprintf(&out, parent,
+				"lxcfs_op_errors_total{op=\"%s\",fs=\"%s\"} %llu\n",
+				op_names[i], area_names[j],
+				(unsigned long long) get(&op_hist[i][j].errors)) );
+		}
+	}
+
+	NIH_MUST( nih_strcat(&out, parent,
+		"# HELP lxcfs_cgmanager_call_duration_seconds Time taken by calls to cgmanager.\n"
+		"# TYPE lxcfs_cgmanager_call_duration_seconds histogram\n") );
+	for (i = 0; i < STATS_NR_CGM; i++) {
+		snprintf(labels, sizeof(labels), "call=\"%s\"", cgm_names[i]);
+		render_hist(&out, parent, "lxcfs_cgmanager_call_duration_seconds", labels,
+			&cgm_hist[i]);
+	}
+
+	NIH_MUST( nih_strcat(&out, parent,
+		"# HELP lxcfs_cgmanager_call_errors_total Calls to cgmanager which failed.\n"
+		"# TYPE lxcfs_cgmanager_call_errors_total counter\n") );
+	for (i = 0; i < STATS_NR_CGM; i++) {
+		NIH_MUST( nih_strcat_sprintf(&out, parent,
+			"lxcfs_cgmanager_call_errors_total{call=\"%s\"} %llu\n",
+			cgm_names[i], (unsigned long long) get(&cgm_hist[i].errors)) );
+	}
+
+	NIH_MUST( nih_strcat_sprintf(&out, parent,
+		"# HELP lxcfs_helper_forks_total Helper processes forked.\n"
+		"# TYPE lxcfs_helper_forks_total counter\n"
+		"lxcfs_helper_forks_total{helper=\"pid\"} %llu\n"
+		"lxcfs_helper_forks_total{helper=\"uptime\"} %llu\n",
+		(unsigned long long) get(&counters[STATS_FORK_PID]),
+		(unsigned long long) get(&counters[STATS_FORK_UPTIME])) );
+
+	NIH_MUST( nih_strcat_sprintf(&out, parent,
+		"# HELP lxcfs_node_lookups_total Lookups which found an inode already in the table.\n"
+		"# TYPE lxcfs_node_lookups_total counter\n"
+		"lxcfs_node_lookups_total{result=\"hit\"} %llu\n"
+		"lxcfs_node_lookups_total{result=\"miss\"} %llu\n",
+		(unsigned long long) get(&counters[STATS_NODE_HIT]),
+		(unsigned long long) get(&counters[STATS_NODE_MISS])) );
+
+	NIH_MUST( nih_strcat_sprintf(&out, parent,
+		"# HELP lxcfs_cgmanager_shared_calls_total Calls to cgmanager answered by an identical one already in flight.\n"
+		"# TYPE lxcfs_cgmanager_shared_calls_total counter\n"
+		"lxcfs_cgmanager_shared_calls_total %llu\n",
+		(unsigned long long) get(&counters[STATS_CGM_SHARED])) );
+
+	NIH_MUST( nih_strcat_sprintf(&out, parent,
+		"# HELP lxcfs_proc_view_reads_total Reads of /proc files kept fresh in the background which found them ready.\n"
+		"# TYPE lxcfs_proc_view_reads_total counter\n"
+		"lxcfs_proc_view_reads_total{result=\"hit\"} %llu\n"
+		"lxcfs_proc_view_reads_total{result=\"miss\"} %llu\n",
+		(unsigned long long) get(&counters[STATS_VIEW_HIT]),
+		(unsigned long long) get(&counters[STATS_VIEW_MISS])) );
+
+	return out;
+}
@@ -0,0 +1,54 @@
+/*
+ * Counters and latency histograms about lxcfs itself, served to root as
+ * /lxcfs/stats.
+ */
+enum stats_op {
+	STATS_GETATTR,
+	STATS_READDIR,
+	STATS_READ,
+	STATS_WRITE,
+	STATS_NR_OPS,
+};
+
+/* which part of the filesystem an op was served from */
+enum stats_area {
+	STATS_PROC,
+	STATS_CGROUP,
+	STATS_SYS,
+	STATS_NR_AREAS,
+};
+
+enum stats_cgm {
+	STATS_CGM_GET_CONTROLLERS,
+	STATS_CGM_LIST_KEYS,
+	STATS_CGM_LIST_CHILDREN,
+	STATS_CGM_GET_PID_CGROUP,
+	STATS_CGM_ESCAPE_CGROUP,
+	STATS_CGM_MOVE_PID,
+	STATS_CGM_GET_VALUE,
+	STATS_CGM_SET_VALUE,
+	STATS_CGM_CREATE,
+	STATS_CGM_CHOWN_FILE,
+	STATS_CGM_CHMOD_FILE,
+	STATS_CGM_REMOVE,
+	STATS_CGM_BATCH,
+	STATS_NR_CGM,
+};
+
+enum stats_counter {
+	STATS_FORK_PID,
+	STATS_FORK_UPTIME,
+	STATS_NODE_HIT,
+	STATS_NODE_MISS,
+	STATS_CGM_SHARED,
+	STATS_VIEW_HIT,
+	STATS_VIEW_MISS,
+	STATS_NR_COUNTERS,
+};
+
+uint64_t stats_now(void);
+void stats_op(enum stats_op op, enum stats_area area, uint64_t start, int ret);
+void stats_cgm(enum stats_cgm call, uint64_t start, bool ok);
+void stats_inc(enum stats_counter c);
+const char *stats_cgm_name(enum stats_cgm call);
+char *stats_render(const void *parent);
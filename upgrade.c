@@ -0,0 +1,322 @@
+/* lxcfs
+ *
+ * Copyright © 2015 Canonical, Inc
+ *
+ * See COPYING file for details.
+ */
+
+/*
+ * The plumbing for live upgrades: starting the new lxcfs, passing things
+ * to it over a unix socket, and giving it a fuse channel on the /dev/fuse
+ * fd it was passed, since it never mounted anything itself.  What is
+ * passed is up to lxcfs.c.
+ */
+#define FUSE_USE_VERSION 26
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fuse_lowlevel.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <nih/alloc.h>
+#include <nih/string.h>
+
+#include "upgrade.h"
+
+/* how long we give the new lxcfs to take over before carrying on ourselves */
+#define UPGRADE_TIMEOUT 10
+
+static char *exe_path;
+
+/*
+ * Remember the binary we were started from.  By the time we are asked to
+ * upgrade, /proc/self/exe points to the deleted old one.
+ */
+void upgrade_init(void)
+{
+	char buf[PATH_MAX];
+	ssize_t n;
+
+	n = readlink("/proc/self/exe", buf, sizeof(buf) - 1);
+	if (n < 0) {
+		fprintf(stderr, "WARNING: can't find our binary, upgrades won't work: %s\n",
+				strerror(errno));
+		return;
+	}
+	buf[n] = '\0';
+	exe_path = NIH_MUST( nih_strdup(NULL, buf) );
+}
+
+/*
+ * Start the new lxcfs with our arguments, plus -o upgrade_fd=N for its end
+ * of a socket to us.  Return our end, or -1 on error.
+ */
+int upgrade_start(char *argv[], pid_t *pid)
+{
+	nih_local char **args = NULL;
+	struct timeval tv = { .tv_sec = UPGRADE_TIMEOUT };
+	char fdopt[30];
+	int sv[2], i, n = 0, fd, maxfd;
+
+	if (!exe_path)
+		return -1;
+
+	for (i = 0; argv[i]; i++)
+		;
+	args = NIH_MUST( nih_alloc(NULL, (i + 3) * sizeof(char *)) );
+	for (i = 0; argv[i]; i++) {
+		/* if we took over from someone ourselves, don't pass that on */
+		if (strcmp(argv[i], "-o") == 0 && argv[i+1] &&
+				strncmp(argv[i+1], "upgrade_fd=", 11) == 0) {
+			i++;
+			continue;
+		}
+		args[n++] = argv[i];
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		return -1;
+	}
+	setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	snprintf(fdopt, sizeof(fdopt), "upgrade_fd=%d", sv[1]);
+	args[n++] = "-o";
+	args[n++] = fdopt;
+	args[n] = NULL;
+
+	*pid = fork();
+	if (*pid < 0) {
+		perror("fork");
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	if (!*pid) {
+		/* everything it needs comes over the socket */
+		maxfd = sysconf(_SC_OPEN_MAX);
+		for (fd = 3; fd < maxfd; fd++) {
+			if (fd != sv[1])
+				close(fd);
+		}
+		execv(exe_path, args);
+		fprintf(stderr, "Failed to exec %s: %s\n", exe_path, strerror(errno));
+		_exit(1);
+	}
+	close(sv[1]);
+	return sv[0];
+}
+
+/* send buf along with fd */
+bool upgrade_send_fd(int sock, int fd, const void *buf, size_t len)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = (void *) buf, .iov_len = len };
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+
+	memset(cbuf, 0, sizeof(cbuf));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	if (sendmsg(sock, &msg, 0) != len) {
+		perror("Error sending fd");
+		return false;
+	}
+	return true;
+}
+
+/* receive what upgrade_send_fd() sent into buf, and return the fd or -1 */
+int upgrade_recv_fd(int sock, void *buf, size_t len)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	ssize_t ret;
+	int fd;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	ret = recvmsg(sock, &msg, MSG_WAITALL);
+	if (ret < 0) {
+		perror("Error receiving fd");
+		return -1;
+	}
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		fprintf(stderr, "No fd in upgrade message\n");
+		return -1;
+	}
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	if (ret != len) {
+		fprintf(stderr, "Short upgrade message\n");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+bool upgrade_write(int sock, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(sock, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			perror("Error writing to upgrade socket");
+			return false;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+bool upgrade_read(int sock, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = read(sock, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			perror("Error reading from upgrade socket");
+			return false;
+		}
+		if (ret == 0) {
+			fprintf(stderr, "Upgrade socket closed early\n");
+			return false;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+/*
+ * A channel on a /dev/fuse fd we did not open ourselves, which behaves
+ * like the one fuse_mount() returns.
+ */
+static int chan_receive(struct fuse_chan **chp, char *buf, size_t size)
+{
+	struct fuse_chan *ch = *chp;
+	struct fuse_session *se = fuse_chan_session(ch);
+	ssize_t res;
+	int err;
+
+	do {
+		res = read(fuse_chan_fd(ch), buf, size);
+		err = errno;
+		/* ENOENT: the request was interrupted before we got to it */
+	} while (res < 0 && err == ENOENT && !fuse_session_exited(se));
+
+	if (fuse_session_exited(se))
+		return 0;
+	if (res < 0) {
+		/* unmounted */
+		if (err == ENODEV) {
+			fuse_session_exit(se);
+			return 0;
+		}
+		if (err != EINTR && err != EAGAIN)
+			perror("fuse: reading device");
+		return -err;
+	}
+	return res;
+}
+
+static int chan_send(struct fuse_chan *ch, const struct iovec iov[], size_t count)
+{
+	int err;
+
+	if (!iov || writev(fuse_chan_fd(ch), iov, count) >= 0)
+		return 0;
+	err = errno;
+	if (!fuse_session_exited(fuse_chan_session(ch)) && err != ENOENT)
+		perror("fuse: writing device");
+	return -err;
+}
+
+static void chan_destroy(struct fuse_chan *ch)
+{
+	close(fuse_chan_fd(ch));
+}
+
+static struct fuse_chan_ops chan_ops = {
+	.receive = chan_receive,
+	.send = chan_send,
+	.destroy = chan_destroy,
+};
+
+struct fuse_chan *upgrade_chan_new(int fd, size_t bufsize)
+{
+	return fuse_chan_new(&chan_ops, fd, bufsize, NULL);
+}
+
+/* a channel which drops whatever is sent to it */
+static int null_receive(struct fuse_chan **chp, char *buf, size_t size)
+{
+	return -EIO;
+}
+
+static int null_send(struct fuse_chan *ch, const struct iovec iov[], size_t count)
+{
+	return 0;
+}
+
+static void null_destroy(struct fuse_chan *ch)
+{
+}
+
+static struct fuse_chan_ops null_ops = {
+	.receive = null_receive,
+	.send = null_send,
+	.destroy = null_destroy,
+};
+
+/*
+ * The kernel sends INIT only once per mount, and the old lxcfs has answered
+ * it.  Feed the same request to our new session through a channel which
+ * drops the reply, so that it ends up set up as the old one was.  Must be
+ * called before the real channel is added to se.
+ */
+bool upgrade_replay_init(struct fuse_session *se, const char *req, size_t len,
+		size_t bufsize)
+{
+	struct fuse_chan *ch;
+
+	ch = fuse_chan_new(&null_ops, -1, bufsize, NULL);
+	if (!ch)
+		return false;
+	fuse_session_add_chan(se, ch);
+	fuse_session_process(se, req, len, ch);
+	fuse_session_remove_chan(ch);
+	fuse_chan_destroy(ch);
+	return true;
+}
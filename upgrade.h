@@ -0,0 +1,43 @@
+/*
+ * Handing a live mount over to a newly started lxcfs.
+ *
+ * The old lxcfs starts the new one with upgrade_start(), which runs it
+ * with -o upgrade_fd=N.  Over that socket it then sends an upgrade_header
+ * along with the /dev/fuse fd, followed by the kernel's INIT request,
+ * nr_nodes upgrade_nodes each followed by its path, and nr_handles
+ * upgrade_handles each followed by its contents.  The new lxcfs answers
+ * with a single byte once it is ready to serve.
+ */
+#define UPGRADE_MAGIC 0x6c786366	/* "lxcf" */
+#define UPGRADE_VERSION 1
+
+struct upgrade_header {
+	uint32_t magic, version;
+	uint64_t bufsize;	/* of the fuse channel */
+	uint64_t init_len;
+	uint64_t next_ino, nr_nodes;
+	uint64_t next_fh, nr_handles;
+};
+
+struct upgrade_node {
+	uint64_t ino, nlookup;
+	uint32_t isdir, pathlen;
+};
+
+struct upgrade_handle {
+	uint64_t fh, size;
+	uint32_t filled, pad;
+};
+
+struct fuse_chan;
+struct fuse_session;
+
+void upgrade_init(void);
+int upgrade_start(char *argv[], pid_t *pid);
+bool upgrade_send_fd(int sock, int fd, const void *buf, size_t len);
+int upgrade_recv_fd(int sock, void *buf, size_t len);
+bool upgrade_write(int sock, const void *buf, size_t len);
+bool upgrade_read(int sock, void *buf, size_t len);
+struct fuse_chan *upgrade_chan_new(int fd, size_t bufsize);
+bool upgrade_replay_init(struct fuse_session *se, const char *req, size_t len,
+		size_t bufsize);